@@ -20,22 +20,58 @@
 
 #include "RandomForest.h"
 #include "DecisionTree.h"
+#include <stdexcept>
 
 class ClassificationForest : public RandomForest {
 
 protected:
+    // when set, trees are evaluated in order and evaluation of a user stops once its
+    // class is decided (see decided())
+    bool _earlyExit;
+    double _confidence;
+    long _treesEvaluated;
+
     void evaluateThread(std::vector<std::vector<double> > *prob);
     void evaluateOOBThread(std::vector<std::vector<double> > *prob, std::vector<int> *permutation, int feature);
-    void evaluate(int uid, std::vector<double> &prob);
-    void evaluate(int uid, std::vector<double> &prob, std::vector<int> &permutation, int feature);
+    // templated on the data type, which is resolved once per block of users
+    template <class D>
+    long evaluate(D &data, int start, int end, std::vector<std::vector<double> > &prob);
+    template <class D>
+    int evaluate(D &data, int uid, std::vector<double> &prob);
+    template <class D>
+    void evaluate(D &data, int start, int end, std::vector<std::vector<double> > &prob, std::vector<int> &permutation, int feature);
+    template <class D>
+    void evaluate(D &data, int uid, std::vector<double> &prob, std::vector<int> &permutation, int feature);
+    bool decided(const std::vector<double> &votes, int cnt, int remaining);
 
-    virtual Tree * getTree() {return new DecisionTree(); }
+    virtual Tree * getTree() {return new DecisionTree(_nLabels); }
     
 public:
-    ClassificationForest(Data *data, int nTrees, int nFeatures, int nThreads) : RandomForest(data, nTrees, nFeatures, nThreads) {} 
+    ClassificationForest(Data *data, int nTrees, int nFeatures, int nThreads) : RandomForest(data, nTrees, nFeatures, nThreads),
+        _earlyExit(false), _confidence(0), _treesEvaluated(0) {
+        _nLabels = data->nLabels();
+        if (ExecutionConfiguration::intExists("earlyexit"))
+            _earlyExit = ExecutionConfiguration::getInt("earlyexit");
+        if (ExecutionConfiguration::doubleExists("confidence")) {
+            _earlyExit = true;
+            _confidence = ExecutionConfiguration::getDouble("confidence");
+        }
+    } 
+
+    // a compacted leaf holds a single class, so forests of several labels are refused
+    // before anything is written
+    virtual void saveCompact(std::ofstream &out) {
+        if (_nLabels > 1)
+            throw std::runtime_error("compacted forests support a single classification label");
+        RandomForest::saveCompact(out);
+    }
 
+    // the probabilities of every user are [label * nClasses + class]. early exit is only
+    // used with a single label
     void evaluate(std::vector<std::vector<double> > &prob);
     void evaluateOOB(std::vector<std::vector<double> > &prob, std::vector<int> &permutation, int feature);
+    // fraction of the trees that were evaluated in the last call to evaluate
+    double treesEvaluated() { return _data->nUsers() > 0 ? (double) _treesEvaluated / _data->nUsers() / _forest.size() : 0; }
 
 };
 
@@ -28,13 +28,24 @@ protected:
     size_t _nUsers;
     size_t _nFeatures;
     size_t _nClasses;
+    size_t _nTargets; // columns of the regression target
+    size_t _nLabels; // columns of the classification target, that all share the classes
 
-    std::vector<double> _regressionY;
-    std::vector<int> _classificationY;
+    std::vector<double> _regressionY; // [target * nUsers + user]
+    std::vector<int> _classificationY; // [label * nUsers + user]
     
     std::vector<int> _featureList;
 
+    // with a projection, only the listed features are loaded, as columns 0, 1, ... in increasing
+    // order of their ids in the feature file. _originalFeatures holds the id of each column
+    bool _projected;
+    std::vector<int> _originalFeatures;
+    size_t _nOriginalFeatures;
+
     virtual void iterator(DataSubsetIterator *iter, int feature, std::vector<int> &indeces) = 0;
+    // for loaders: sets the number of features for a file with nColumns of them, and maps each
+    // to its column, or to -1 when the projection drops it
+    void projectColumns(int nColumns, std::vector<int> &columns);
     
 public:
     virtual ~Data() {}
@@ -43,12 +54,28 @@ public:
         _nUsers = 0;
         _nFeatures = 0;
         _nClasses = 0;
+        _nTargets = 1;
+        _nLabels = 1;
+        _projected = false;
+        _nOriginalFeatures = 0;
     }
     virtual void loadFeatures(std::string filename) = 0;
     virtual bool at(int user, int feature, double &v) = 0;
-    void filterFeatures(std::string filename);
+    // kernels templated on the data type call get(), which subclasses hide with an inline,
+    // non-virtual version. for a plain Data, it is the virtual at()
+    bool get(int user, int feature, double &v) {
+        return at(user, feature, v);
+    }
+    // drops all but the listed features while loading, so that they don't take memory.
+    // set before loadFeatures()
+    void projectFeatures(const std::vector<int> &features);
+    // reads a feature filter, for projectFeatures()
+    static void readFeatureFilter(std::string filename, std::vector<int> &features);
+    // the targets only depend on their file, and can be loaded while the features load.
+    // checkTargets() then checks that they have a row per user
     void loadClassificationY(std::string filename);
     void loadRegressionY(std::string filename);
+    void checkTargets();
 
     int nClasses() {
         return _nClasses;
@@ -62,6 +89,19 @@ public:
         return _featureList.size();
     }
 
+    // the number of features in the feature file, including those dropped by a projection
+    int nOriginalFeatures() {
+        return _projected ? _nOriginalFeatures : _nFeatures;
+    }
+
+    // the id in the feature file of column f
+    int originalFeature(int f) {
+        return _projected ? _originalFeatures[f] : f;
+    }
+
+    // the column of a feature file id, or -1 if the projection dropped it
+    int projectedFeature(int original);
+
     int nUsers() {
         return _nUsers;
     }
@@ -70,10 +110,26 @@ public:
         return _classificationY[u];
     }
 
+    int classificationY(int u, int label) {
+        return _classificationY[label * _nUsers + u];
+    }
+
     double regressionY(int u) {
         return _regressionY[u];
     }
 
+    double regressionY(int u, int target) {
+        return _regressionY[target * _nUsers + u];
+    }
+
+    int nTargets() {
+        return _nTargets;
+    }
+
+    int nLabels() {
+        return _nLabels;
+    }
+
     // creates a subset that includes the entire data set
     class DataSubset createSubset();
 
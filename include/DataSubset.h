@@ -20,16 +20,23 @@
 #include "Data.h"
 #include <vector>
 #include <iostream>
+#include <boost/random/mersenne_twister.hpp>
 
 class DataSubsetIterator {
     friend class DenseData;
     friend class SparseData;
 private:
-    std::vector<int> *_rows;
-    std::vector<double> *_vals;
+    // for sparse data, _rows and _vals start at the feature's column, and _indeces are
+    // positions within it. a column has at most one value per user, so they fit in an int
+    const int *_rows;
+    const double *_vals;
     std::vector<int> _indeces;
     int _idx;
     int _size;
+    bool _sparse;
+    // the rows and values found in a compressed column, which _rows and _vals point to
+    std::vector<int> _rowBuffer;
+    std::vector<double> _valBuffer;
 
 public:
     DataSubsetIterator(DataSubset &ds, int feature);
@@ -47,14 +54,29 @@ public:
     }
 
     int index() {
-        if (!_rows) 
+        if (!_sparse) 
             return _indeces[_idx];
         
-        return _rows->at(_indeces[_idx]);
+        return _rows[_indeces[_idx]];
     }
 
     double value() {
-        return _vals->at(_indeces[_idx]);
+        return _vals[_indeces[_idx]];
+    }
+
+    bool isSparse() {
+        return _sparse;
+    }
+
+    // unchecked versions of index() and value(), for kernels templated on isSparse()
+    template <bool sparse>
+    int index() {
+        return sparse ? _rows[_indeces[_idx]] : _indeces[_idx];
+    }
+
+    template <bool sparse>
+    double value() {
+        return _vals[_indeces[_idx]];
     }
 
     void reset() {
@@ -69,32 +91,53 @@ public:
 private:
     Data *_data;
     std::vector<int> _userIndeces;
-    DataSubset(Data *data, const std::vector<int> &indeces);
+    DataSubset(Data *data, const std::vector<int> &indeces, bool sorted);
 
 public:
 
     DataSubset(Data *data);
 
-    std::vector<int> getSomeFeatures(int nFeatures);
+    // draws nFeatures of the features with rng, so a tree samples the same features for the same seed
+    std::vector<int> getSomeFeatures(int nFeatures, boost::mt19937 &rng);
 
     const std::vector<int> &getUsers() {
         return _userIndeces;
     }
 
+    // fills tmp with a random permutation of 0 ... tmp.size() - 1
     static void permute(std::vector<int> &tmp);
+    // puts the entries of tmp in a random order
+    static void shuffle(std::vector<int> &tmp);
+    static void shuffle(std::vector<int> &tmp, boost::mt19937 &rng);
 
     int classificationY(int u) {
         return _data->_classificationY[u];
     }
 
+    int classificationY(int u, int label) {
+        return _data->_classificationY[label * _data->_nUsers + u];
+    }
+
     double regressionY(int u) {
         return _data->_regressionY[u];
     }
 
+    double regressionY(int u, int target) {
+        return _data->_regressionY[target * _data->_nUsers + u];
+    }
+
+    int nTargets() {
+        return _data->_nTargets;
+    }
+
     int nClasses() {
         return _data->_nClasses;
     }
 
+    int nLabels() {
+        return _data->_nLabels;
+    }
+
     int nUsers() {
         return _userIndeces.size();
     }
@@ -107,10 +150,11 @@ public:
         return _data->at(user, feature, v);
     }
 
-    // creates a subset of all features for selected users
+    // creates a subset of all features for selected users. sorted skips sorting users that
+    // are already in increasing order
 
-    DataSubset createSubsetUsers(const std::vector<int> &users) {
-        return DataSubset(_data, users);
+    DataSubset createSubsetUsers(const std::vector<int> &users, bool sorted = false) {
+        return DataSubset(_data, users, sorted);
     }
     
     friend class DataSubsetIterator;
@@ -23,22 +23,61 @@ class DecisionTree : public Tree {
     
 protected: 
     
-    bool isSingleClass(DataSubset &data, const std::vector<int> &users);
-    int mostPopularClass(DataSubset &data, const std::vector<int> &users);
+    // with more than one label, a leaf's _cls is the index of its classes in _outputs,
+    // [leaf * nLabels + label]. leaf 0 is all -1, for _empty
+    int _nLabels;
+    std::vector<int> _outputs;
+
+    bool isSingleClass(DataSubset &data, const std::vector<int> &users, int label = 0);
+    int mostPopularClass(DataSubset &data, const std::vector<int> &users, int label = 0);
+    int mostPopularClasses(DataSubset &data, const std::vector<int> &users);
     virtual bool checkAndMakeLeaf(DataSubset &data, const std::vector<int> &userIndeces, Node *node, int depth, bool forceLeaf = false);
+    virtual void clearValues();
+    void bestThresholdLabels(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &gini, double &split);
+
+    // copies the classes of a leaf, one per label, to out
+    void copyClasses(Node *node, int *out) {
+        if (_nLabels == 1) {
+            out[0] = node->_cls;
+        } else {
+            const int *c = &_outputs[node->_cls * _nLabels];
+            std::copy(c, c + _nLabels, out);
+        }
+    }
 
     virtual void load(Node *node, std::ifstream &in);
     virtual void save(Node *node, std::ofstream &out);
+    virtual void saveValue(Node *node, std::ostream &out);
+    virtual void loadValue(Node *node, std::istream &in);
     
     
 public:
     virtual ~DecisionTree() {};
-    DecisionTree();
-    void bestThreshold(DataSubset &data, int feature, double &gini, double &split);
+    DecisionTree(int nLabels = 1);
+    virtual void bestThreshold(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &gini, double &split);
+    virtual double scoreThreshold(DataSubset &data, const std::vector<int> &noValue, const std::vector<double> &values, const std::vector<int> &users, double threshold);
+
+    int nLabels() { return _nLabels; }
 
+    // the class of each label, -1 for a leaf that had no users
     virtual void evaluate (Data &data, int uid, int *out);    
     virtual bool evaluateOOB (Data &data, int uid, std::vector<int> &permutation, int feature, int *out);    
 
+    // non-virtual versions for a known data type, see Tree::getNode
+    template <class D>
+    void evaluate (D &data, int uid, int *out) {
+        copyClasses(getNode(data, uid), out);
+    }
+
+    template <class D>
+    bool evaluateOOB (D &data, int uid, std::vector<int> &permutation, int feature, int *out) {
+        Node *node = getNodeOOB(data, uid, permutation, feature);
+        if (!node) 
+            return false;
+        copyClasses(node, out);
+        return true;
+    }
+
 };
 
 #endif	/* DECISIONTREE_H */
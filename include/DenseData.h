@@ -23,14 +23,29 @@
 class DenseData : public Data {
 protected:
     std::vector<std::vector<double> > _features; // [feature][user]
+    // evaluation only needs the values of one user at a time, so the row major layout keeps
+    // them on the same cache lines while all the trees traverse the row. it cannot be iterated
+    bool _rowMajor;
+    std::vector<double> _rows; // [user * nFeatures + feature]
 public:
 
-    DenseData() : Data() {
+    DenseData(bool rowMajor = false) : Data(), _rowMajor(rowMajor) {
     }
 
     virtual void iterator(DataSubsetIterator *iter, int feature, std::vector<int> &indeces);
     virtual void loadFeatures(std::string filename);
     virtual bool at(int user, int feature, double &v);
+    // replaces the data with rows in row major order, that are only evaluated. rows gets the
+    // previous values, so that its memory can be reused
+    void loadRows(std::vector<double> &rows, int nFeatures);
+
+    bool get(int user, int feature, double &v) {
+        if (_rowMajor)
+            v = _rows[(size_t) user * _nFeatures + feature];
+        else
+            v = _features[feature][user];
+        return true;
+    }
 };
 
 #endif	/* DENSEDATA_H */
@@ -43,6 +43,7 @@ class ExecutionConfiguration
             return _ints[prop]; 
         }
 	static bool intExists(std::string prop) { return _ints.find(prop) != _ints.end(); }
+	static void setInt(std::string prop, int value) { _ints[prop] = value; }
 	static double getDouble(std::string prop) { 
             if (_doubles.find(prop) == _doubles.end())
                 throw std::range_error("invalid double property " + prop);
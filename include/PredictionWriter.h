@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014 Ofer Shai
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef PREDICTIONWRITER_H
+#define	PREDICTIONWRITER_H
+
+#include <string>
+#include <vector>
+
+// Writes a matrix of predictions, a row per user and a column per class or target.
+// text is a Matrix Market array, in its column major order, formatted like an ostream
+// with the default precision. blocks of values are formatted by several threads, and
+// written with one call per block.
+// binary is the header
+//   "RFPB" <rows: 64 bit unsigned> <columns: 32 bit unsigned>
+// followed by the values as 32 bit floats, one row after another, in native byte order.
+class PredictionWriter {
+protected:
+    int _nThreads;
+    bool _binary;
+
+    template <class M>
+    void write(const std::string &filename, const M &matrix);
+    template <class M>
+    void writeText(std::ofstream &out, const M &matrix);
+    template <class M>
+    void writeBinary(std::ofstream &out, const M &matrix);
+
+public:
+    PredictionWriter(int nThreads, bool binary) : _nThreads(nThreads < 1 ? 1 : nThreads), _binary(binary) {}
+
+    // values of row u are at [u * nCols, (u + 1) * nCols)
+    void write(const std::string &filename, const std::vector<double> &values, int nCols);
+    void write(const std::string &filename, const std::vector<std::vector<double> > &rows, int nCols);
+
+    // formats v into buf as "%g" would, and returns its length. buf needs 32 chars
+    static int format(double v, char *buf);
+};
+
+#endif	/* PREDICTIONWRITER_H */
+
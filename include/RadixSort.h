@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2014 Ofer Shai
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef RADIXSORT_H
+#define	RADIXSORT_H
+
+#include <vector>
+
+// sorts values in increasing order, and sets order[i] to the original position of the
+// i-th smallest value. the sort is stable, and uses scratch buffers kept per thread.
+void radixSort(std::vector<double> &values, std::vector<unsigned int> &order);
+
+#endif	/* RADIXSORT_H */
+
@@ -21,7 +21,10 @@
 #include "Tree.h"
 #include "DecisionTree.h"
 #include "RegressionTree.h"
+#include "ExecutionConfiguration.h"
 #include <boost/thread.hpp>
+#include <fstream>
+#include <ctime>
 
 class RandomForest {
 protected:
@@ -29,37 +32,90 @@ protected:
     int _nTrees;
     int _nFeatures;
     int _nThreads;
-    int _nClasses; // only used in ClassificationForest, but doesn't hurt RegressionForest, so leave here to use more code in common
+    // the classes of a ClassificationForest. a RegressionForest keeps its number of targets here when
+    // it has more than one, and 0 otherwise, so saved single target forests are unchanged
+    int _nClasses;
+    int _nLabels; // columns of a multi-label classification target, 1 otherwise
 
     std::vector<Tree *> _forest;
+    std::vector<int> _seeds; // seed of the bagging for each tree in _forest
+    Tree::CompactTable *_table; // the nodes shared by the trees of a loaded compacted forest
+    int _seed;
+    bool _bootstrap; // whether each tree is trained on a bag drawn with replacement, or on all users
+    double _bagFraction; // size of each bag, as a fraction of the users
+    bool _replacement; // whether bags are drawn with replacement
     
     int _counter;
     int _increment;
     boost::mutex _mtx;
+
+    // finished trees are appended to the checkpoint every _checkpointInterval trees
+    std::ofstream _checkpoint;
+    int _checkpointInterval;
+    std::vector<int> _finished;
     
-    void trainTrees(int seed);
+    void trainTrees();
+    void writeCheckpoint();
 
     virtual Tree * getTree()  = 0;
+    // what _nClasses should be for the targets loaded in _data
+    virtual int dataClasses() { return _data->nClasses(); }
+    void loadCompact(std::ifstream &in);
+    // the classes in the header of a forest file, followed by the number of labels when there is
+    // more than one, so that files of a single label are unchanged. reads to the end of the line
+    void writeClasses(std::ostream &out);
+    static void readClasses(std::istream &in, int &nClasses, int &nLabels);
+    // deletes all the trees
+    void clear();
     
 public:
     RandomForest(Data *data, int nTrees, int nFeatures, int nThreads) : _data(data), 
-        _nTrees(nTrees), _nFeatures(nFeatures), _nThreads(nThreads) {
+        _nTrees(nTrees), _nFeatures(nFeatures), _nThreads(nThreads), _table(NULL), _checkpointInterval(0) {
         _nClasses = data->nClasses();
+        _nLabels = 1;
+        _seed = ExecutionConfiguration::intExists("seed") ? ExecutionConfiguration::getInt("seed") : std::time(0);
+        _bootstrap = !ExecutionConfiguration::intExists("bootstrap") || ExecutionConfiguration::getInt("bootstrap") != 0;
+        _bagFraction = ExecutionConfiguration::doubleExists("bagfraction") ? ExecutionConfiguration::getDouble("bagfraction") : 1;
+        _replacement = !ExecutionConfiguration::intExists("replacement") || ExecutionConfiguration::getInt("replacement") != 0;
     }
     
     
-    virtual ~RandomForest() {}
+    virtual ~RandomForest() {
+        clear();
+    }
     
     void train();
+    // trains additional trees onto a loaded forest, until it has nTrees trees
+    void grow(int nTrees);
     void save(std::ofstream &out);
     void load(std::ifstream &in);
+    // saves the forest with identical subtrees shared, and thresholds rounded using the data
+    virtual void saveCompact(std::ofstream &out);
+    // starts a new checkpoint file, that trees are written to while training
+    void checkpoint(const std::string &filename, int interval);
+    // loads the trees saved in a checkpoint file, and continues writing to it
+    void resume(const std::string &filename, int interval);
+    // concatenates forests written by save() into a single forest
+    static void merge(const std::vector<std::string> &filenames, std::ofstream &out);
     int nClasses() { return _nClasses; }
+    int nLabels() { return _nLabels; }
+    void setSeed(int seed) { _seed = seed; }
+    // replaces the data set that is evaluated, e.g. with a batch of rows to score
+    void setData(Data *data) { _data = data; }
 
     void findUsedFeatures(std::vector<bool> &features) {
         for (int i = 0; i < _nTrees; i++) {
 	    _forest[i]->findUsedFeatures(features);
 	}
     }
+
+    // the highest feature any of the trees splits on, -1 if none
+    int maxFeature() {
+        int feature = -1;
+        for (size_t i = 0; i < _forest.size(); i++)
+            feature = std::max(feature, _forest[i]->maxFeature());
+        return feature;
+    }
 };
 
 #endif	/* RANDOMFOREST_H */
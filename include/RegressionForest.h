@@ -19,21 +19,42 @@
 #define	REGRESSIONFOREST_H
 
 #include "RandomForest.h"
+#include <stdexcept>
 
 class RegressionForest : public RandomForest {
 
 protected:
     void evaluateThread(std::vector<double> *out);
     void evaluateOOBThread(std::vector<double> *out, std::vector<int> *permutation, int feature);
-    double evaluate(int uid);
-    double evaluate(int uid, std::vector<int> &permutation, int feature);
+    // templated on the data type, which is resolved once per block of users
+    template <class D>
+    void evaluate(D &data, int start, int end, std::vector<double> &out);
+    template <class D>
+    void evaluate(D &data, int uid, double *out);
+    template <class D>
+    void evaluate(D &data, int start, int end, std::vector<double> &out, std::vector<int> &permutation, int feature);
+    template <class D>
+    void evaluate(D &data, int uid, std::vector<int> &permutation, int feature, double *out);
 
-    virtual Tree * getTree() {return new RegressionTree(); }
+    virtual Tree * getTree() {return new RegressionTree(nTargets()); }
+    virtual int dataClasses() { return _data->nTargets() > 1 ? _data->nTargets() : 0; }
     
 public:
     RegressionForest(Data *data, int nTrees, int nFeatures, int nThreads) : RandomForest(data, nTrees, nFeatures, nThreads) {        
+        _nClasses = dataClasses();
     }
     
+    int nTargets() { return _nClasses > 1 ? _nClasses : 1; }
+
+    // a compacted leaf holds a single value, so forests of several targets are refused
+    // before anything is written
+    virtual void saveCompact(std::ofstream &out) {
+        if (nTargets() > 1)
+            throw std::runtime_error("compacted forests support a single regression target");
+        RandomForest::saveCompact(out);
+    }
+
+    // Y holds the outputs of every user, [user * nTargets + target]
     void evaluate(std::vector<double> &Y);
     void evaluateOOB(std::vector<double> &Y, std::vector<int> &permutation, int feature);
 
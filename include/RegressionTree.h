@@ -23,21 +23,61 @@ class RegressionTree : public Tree {
     
 protected: 
     
+    // with more than one target, a leaf's _cls is the index of its outputs in _outputs,
+    // [leaf * nTargets + target]. leaf 0 is all zeros, for _empty
+    int _nTargets;
+    std::vector<double> _outputs;
+
     bool isSingleValue(DataSubset &data, const std::vector<int> &users);
     double averageValue(DataSubset &data, const std::vector<int> &users);
+    int averageValues(DataSubset &data, const std::vector<int> &users);
     virtual bool checkAndMakeLeaf(DataSubset &data, const std::vector<int> &userIndeces, Node *node, int depth, bool forceLeaf = false);
+    virtual void clearValues();
+    void bestThresholdTargets(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &val, double &split);
+
+    // adds the outputs of a leaf to out
+    void addValues(Node *node, double *out) {
+        if (_nTargets == 1) {
+            out[0] += node->_val;
+        } else {
+            const double *v = &_outputs[node->_cls * _nTargets];
+            for (int t = 0; t < _nTargets; t++)
+                out[t] += v[t];
+        }
+    }
 
     virtual void load(Node *node, std::ifstream &in);
     virtual void save(Node *node, std::ofstream &out);
+    virtual void saveValue(Node *node, std::ostream &out);
+    virtual void loadValue(Node *node, std::istream &in);
 
     
 public:
     virtual ~RegressionTree() {};
-    RegressionTree();
-    void bestThreshold(DataSubset &data, int feature, double &val, double &split);
+    RegressionTree(int nTargets = 1);
+    virtual void bestThreshold(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &val, double &split);
+    virtual double scoreThreshold(DataSubset &data, const std::vector<int> &noValue, const std::vector<double> &values, const std::vector<int> &users, double threshold);
+
+    int nTargets() { return _nTargets; }
 
+    // add the outputs of the tree, one per target, to out
     virtual void evaluate (Data &data, int uid, double *out);    
     virtual bool evaluateOOB (Data &data, int uid, std::vector<int> &permutation, int feature, double *out);    
+
+    // non-virtual versions for a known data type, see Tree::getNode
+    template <class D>
+    void evaluate (D &data, int uid, double *out) {
+        addValues(getNode(data, uid), out);
+    }
+
+    template <class D>
+    bool evaluateOOB (D &data, int uid, std::vector<int> &permutation, int feature, double *out) {
+        Node *node = getNodeOOB(data, uid, permutation, feature);
+        if (!node) 
+            return false;
+        addValues(node, out);
+        return true;
+    }
 };
 
 #endif	/* DECISIONTREE_H */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2014 Ofer Shai
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SCORINGSERVER_H
+#define	SCORINGSERVER_H
+
+#include "RandomForest.h"
+#include <boost/thread.hpp>
+#include <deque>
+#include <string>
+#include <vector>
+
+// Serves a loaded forest over a unix domain socket. Every connection sends one
+// request per line:
+//   dense <v0> <v1> ...           values for features 0, 1, ...
+//   sparse <f>:<v> <f>:<v> ...    feature/value pairs, missing features are no-value
+//   stats                         latency and throughput since startup
+// and gets back one line per request (class probabilities, or the regression value of each target).
+// Rows from concurrent connections are coalesced into a single batch that is
+// evaluated on the forest's thread pool.
+class ScoringServer {
+protected:
+
+    class Request {
+    public:
+        std::vector<std::pair<int, double> > _row;
+        std::vector<double> _result;
+        double _start;
+        bool _done;
+
+        Request() : _start(0), _done(false) {}
+    };
+
+    RandomForest *_forest;
+    bool _classification;
+    int _batchSize;  // maximum number of rows evaluated together
+    int _batchWait;  // microseconds to wait for a batch to fill up
+
+    std::deque<Request *> _queue;
+    boost::mutex _mtx;
+    boost::condition_variable _queued;
+    boost::condition_variable _evaluated;
+
+    // statistics, guarded by _mtx
+    std::vector<double> _latencies; // the most recent request latencies, in seconds
+    size_t _nextLatency;
+    long _nRequests;
+    long _nBatches;
+    double _startTime;
+
+    void batchThread();
+    void connectionThread(int fd);
+    void evaluateBatch(std::vector<Request *> &batch);
+    bool parseRequest(const std::string &line, Request &request, std::string &error);
+    std::string stats();
+
+    static double now();
+
+public:
+    ScoringServer(RandomForest *forest, bool classification, int batchSize, int batchWait);
+
+    void run(const std::string &path);
+};
+
+#endif	/* SCORINGSERVER_H */
+
@@ -25,24 +25,75 @@
 class SparseData : public Data {
 protected:
 
-    std::vector<int> _user;
+    // _user and _featureT hold offsets into the values, which may pass 2^31. the users and
+    // features themselves fit in an int
+    std::vector<long> _user;
     std::vector<int> _feature;
     std::vector<double> _val;
 
     std::vector<int> _userT;
-    std::vector<int> _featureT;
+    std::vector<long> _featureT;
     std::vector<double> _valT;
+    // whether the column layout used by iterator() is built. evaluation only reads rows
+    bool _columns;
+    int _nThreads; // threads used by transpose()
 
-    void transpose();
+    // with _compressed, the rows of the columns are kept in blocks instead of _userT: the first
+    // row of each block, and the differences to the following rows packed in as many bits as
+    // the largest difference in the block needs
+    bool _compressed;
+    std::vector<long> _blockT;             // end of each feature's blocks
+    std::vector<int> _blockFirst;          // first row of each block
+    std::vector<unsigned char> _blockWidth; // bits per difference in each block
+    std::vector<long> _blockByte;          // start of each block in _packed
+    std::vector<unsigned char> _packed;
+
+    // counts holds the number of values of each feature
+    void transpose(std::vector<int> &counts);
+    // counts the values of each feature in the rows [start, end)
+    void countRange(int start, int end, std::vector<int> *counts);
+    // scatters the rows [start, end) into the columns, at the positions in offsets
+    void scatterRange(int start, int end, std::vector<long> *offsets);
+
+    // replaces _userT with the packed blocks
+    void compress();
+    // measures or packs the blocks of the features [start, end)
+    void measureBlocks(int start, int end);
+    void packBlocks(int start, int end);
+    // decodes the n rows of block b
+    void unpackBlock(long b, int n, int *rows);
+    void compressedIterator(DataSubsetIterator *iter, int feature, std::vector<int> &indeces);
+    // splits the features into ranges with about the same number of values, one per thread
+    std::vector<int> featureRanges();
 
 public:
 
-    SparseData() : Data() {
+    SparseData(bool columns = true, int nThreads = 1, bool compressed = false) : Data(), _columns(columns),
+            _nThreads(nThreads < 1 ? 1 : nThreads), _compressed(compressed) {
     }
 
     virtual void iterator(DataSubsetIterator *iter, int feature, std::vector<int> &);
     virtual void loadFeatures(std::string filename);
+    // loads rows that are already in memory, as (feature, value) pairs sorted by feature
+    void loadRows(const std::vector<std::vector<std::pair<int, double> > > &rows);
     virtual bool at(int user, int feature, double &v);
+
+    bool get(int user, int feature, double &v) {
+        long start = user == 0 ? 0 : _user[user - 1];
+        long end = _user[user];
+        while (end > start) {
+            long idx = (start + end) / 2;
+            if (_feature[idx] == feature) {
+                v = _val[idx];
+                return true;
+            } else if (_feature[idx] < feature) {
+                start = idx + 1;
+            } else {
+                end = idx;
+            }
+        }
+        return false;
+    }
 };
 
 
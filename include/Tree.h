@@ -18,18 +18,26 @@
 #define	TREE_H
 
 #include "DataSubset.h"
+#include <boost/random.hpp>
 #include <fstream>
+#include <algorithm>
+#include <cassert>
+#include <tr1/unordered_map>
 
 class Tree {
     
 protected: 
     
+    // kinds of nodes in a saved tree. a binary node has no _noValue child, since
+    // none of its users were missing the feature when it was trained
+    enum { INTERNAL = 0, LEAF = 1, BINARY = 2 };
+
     class Node {
     public:
         bool   _isLeaf;
         double _threshold;
         int    _feature;
-        Node   *_noValue;
+        Node   *_noValue;    // NULL for a binary node
         Node   *_greaterThan;
         Node   *_lessThan;        
         union {
@@ -38,36 +46,248 @@ protected:
         };
         
         void splitData(DataSubset &data, std::vector<int> &noVal, std::vector<int> &greater, std::vector<int> &less);
+        template <bool sparse>
+        void splitData(DataSubset &data, DataSubsetIterator &u, std::vector<int> &noVal, std::vector<int> &greater, std::vector<int> &less);
 	void findUsedFeatures(std::vector<bool> &features);
+        int maxFeature(); // the highest feature split on below the node, -1 for a leaf
         Node() :  _isLeaf(true), _threshold(0), _feature(-1), _noValue(NULL), _greaterThan(NULL), _lessThan(NULL), _cls(-1) {}  
     };
-    
+
+    // allocates nodes from blocks of growing size, that are all freed together when the pool
+    // is destroyed. a pool is only used by one thread at a time, so it needs no locking
+    class NodePool {
+    private:
+        std::vector<Node *> _blocks;
+        size_t _blockSize;
+        size_t _used; // nodes handed out from the last block
+
+        NodePool(const NodePool &);
+        NodePool &operator=(const NodePool &);
+
+    public:
+        NodePool() : _blockSize(0), _used(0) {}
+        ~NodePool() { clear(); }
+
+        Node *allocate() {
+            if (_used == _blockSize) {
+                _blockSize = _blockSize == 0 ? 64 : std::min(_blockSize * 2, (size_t) 4096);
+                _blocks.push_back(new Node[_blockSize]);
+                _used = 0;
+            }
+            return &_blocks.back()[_used++];
+        }
+
+        void clear() {
+            for (size_t i = 0; i < _blocks.size(); i++)
+                delete[] _blocks[i];
+            _blocks.clear();
+            _blockSize = 0;
+            _used = 0;
+        }
+    };
+
+    NodePool _nodes; // every node of the tree except _root and _empty
     Node _root;
+    Node _empty; // the leaf reached by a user that is missing the feature of a binary node
+
+    // the tree laid out for evaluation, 16 bytes per node. the children of a node are adjacent,
+    // lessThan, greaterThan and then noValue unless the node is binary, starting _offset nodes
+    // after it. a leaf points to the node holding its value
+    class FlatNode {
+    public:
+        enum { LEAF = 1u << 31, BINARY = 1u << 30, FEATURE = BINARY - 1 };
+
+        union {
+            double _threshold;
+            Node *_leaf;
+        };
+        unsigned int _feature; // the feature, with the LEAF and BINARY flags
+        int _offset;
+    };
+
+    std::vector<FlatNode> _flat;
+    const FlatNode *_flatRoot; // the root of the layout, in _flat or in a CompactTable. NULL without one
+    void flatten(Node *node, size_t index);
     int _maxDepth;
     int _minSplit;
+    bool _levelWise;
+    bool _extraTrees;
+    boost::mt19937 _rng; // draws the sampled features, and the thresholds of extremely randomized trees
     std::vector<int> _users;
     void train(DataSubset &data, const std::vector<int> &userIndeces, Node *node, int nFeatures, int depth);
+    void trainLevels(DataSubset &data, int nFeatures);
     virtual bool checkAndMakeLeaf(DataSubset &data, const std::vector<int> &userIndeces, Node *node, int depth, bool forceLeaf = false) = 0;
-    virtual void bestThreshold(DataSubset &data, int feature, double &gini, double &split) = 0;    
+    // drops leaf values kept outside the nodes, before the tree is trained or loaded again
+    virtual void clearValues() {}
+    void bestThreshold(DataSubset &data, int feature, double &score, double &split);
+    // the split search over one feature. values[i] is the value of users[i], and noValue are the
+    // users that are missing the feature, both in increasing user order. values gets sorted
+    virtual void bestThreshold(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &score, double &split) = 0;
+    // the score of splitting the same lists at threshold, in a single pass
+    virtual double scoreThreshold(DataSubset &data, const std::vector<int> &noValue, const std::vector<double> &values, const std::vector<int> &users, double threshold) = 0;
+    // the best threshold, or a random one for extremely randomized trees
+    void findSplit(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &score, double &split);
+
+    // templated on the data type, so that D::get() is inlined into the traversal.
+    // with D = Data, every node visit is a virtual call
+    template <class D>
+    Node *getNode(D &data, int uid) {
+        if (_flatRoot)
+            return getFlatNode(data, uid);
+
+        Node *node = &_root;
+
+        while (!node->_isLeaf) {
+            double v;
+            if (data.get(uid, node->_feature, v)) {
+                if (v < node->_threshold)
+                    node = node->_lessThan;
+                else
+                    node = node->_greaterThan;
+            }
+            else {
+                node = node->_noValue ? node->_noValue : &_empty;
+            }
+        }
+
+        return node;
+    }
+
+    template <class D>
+    Node *getFlatNode(D &data, int uid) {
+        const FlatNode *node = _flatRoot;
+
+        while (!(node->_feature & FlatNode::LEAF)) {
+            double v;
+            if (data.get(uid, node->_feature & FlatNode::FEATURE, v))
+                node += node->_offset + (v < node->_threshold ? 0 : 1);
+            else if (node->_feature & FlatNode::BINARY)
+                return &_empty;
+            else
+                node += node->_offset + 2;
+        }
 
-    Node *getNode(Data &data, int uid);
-    Node *getNodeOOB (Data &data, int uid, std::vector<int> &permutation, int feature);
+        return node->_leaf;
+    }
+
+    template <class D>
+    Node *getNodeOOB (D &data, int uid, std::vector<int> &permutation, int feature) {
+        if (std::binary_search(_users.begin(), _users.end(), uid))
+            return NULL;
+
+        Node *node = &_root;
+        while (!node->_isLeaf) {
+            double v;
+            bool valueExists;
+            if (node->_feature == feature) {
+                assert(uid < permutation.size());
+                valueExists = data.get(permutation[uid], feature, v);
+            }
+            else
+                valueExists = data.get(uid, node->_feature, v);
+
+            if (valueExists) {
+                if (v < node->_threshold)
+                    node = node->_lessThan;
+                else
+                    node = node->_greaterThan;
+            }
+            else
+                node = node->_noValue ? node->_noValue : &_empty;
+        }
+        return node;
+    }
 
     virtual void save(Node *node, std::ofstream &out) = 0;
     virtual void load(Node *node, std::ifstream &in) = 0;
+    // the data whose columns the features of the nodes are translated from or to while saving or
+    // loading, or NULL. saved trees use the feature ids of the feature file
+    Data *_featureIds;
+    int savedFeature(Node *node);
+    int loadedFeature(int feature);
+    // kinds of nodes in a compacted forest. a float node's threshold was rounded to float, and is
+    // written with the fewest digits that read back exactly that float, at most 9
+    enum { COMPACT_DOUBLE = 0, COMPACT_LEAF = 1, COMPACT_FLOAT = 2 };
+    static int floatDigits(float value);
+    // the value of a leaf, as written in a compacted forest
+    virtual void saveValue(Node *node, std::ostream &out) = 0;
+    virtual void loadValue(Node *node, std::istream &in) = 0;
+
+    class NodeKey {
+    public:
+        bool _isLeaf;
+        int _value; // bits of the leaf's class or value
+        int _feature;
+        double _threshold;
+        int _children[3];
+
+        bool operator==(const NodeKey &other) const;
+    };
+
+    class NodeKeyHash {
+    public:
+        size_t operator()(const NodeKey &key) const;
+    };
     
-    
+public:
+
+    // nodes of compacted trees. identical subtrees of all the trees compacted into
+    // the same table are stored once, and thresholds are rounded to float wherever
+    // that doesn't change the routing of the training data
+    class CompactTable {
+    public:
+        Data *_data;
+        NodePool _pool; // owns the nodes, trees rooted in the table need it to stay alive
+        std::vector<Node *> _nodes; // children always come before their parents
+        std::vector<bool> _isDouble; // whether the node's threshold needs double precision
+        std::tr1::unordered_map<NodeKey, int, NodeKeyHash> _index;
+        std::vector<std::vector<double> > _values; // sorted distinct training values, per feature
+        long _nCompacted; // number of nodes before compaction
+        // the layout of all the trees, see flatten(). a shared subtree is laid out once
+        std::vector<FlatNode> _flat;
+
+        CompactTable(Data *data) : _data(data), _nCompacted(0) {}
+        const std::vector<double> &values(int feature);
+        // lays the nodes out for evaluation. the first slots hold the roots of the trees, followed by
+        // a group of children for every internal node, which all the parents of the node point to
+        void flatten(const std::vector<int> &roots);
+        // the bytes taken by the nodes and layout of the table, and by those of the trees it compacted
+        size_t bytes() { return _nodes.size() * sizeof(Node) + _flat.size() * sizeof(FlatNode); }
+        size_t compactedBytes() { return _nCompacted * (sizeof(Node) + sizeof(FlatNode)); }
+
+    private:
+        void flatten(size_t slot, Node *node, std::tr1::unordered_map<Node *, size_t> &groups);
+    };
+
+protected:
+    int compact(Node *node, CompactTable &table);
+
 public:
     Tree();
     virtual ~Tree() {}
     void train(DataSubset &data, int nFeatures);
+    void setSeed(int seed) { _rng.seed(seed); }
+
+    // with data, features are translated between its columns and the ids in its feature file
+    void save(std::ofstream &out, Data *data = NULL);
+    void load(std::ifstream &in, Data *data = NULL);
+    // lays the tree out for faster evaluation. training or loading the tree again drops the layout
+    void flatten();
 
-    void save(std::ofstream &out);
-    void load(std::ifstream &in);
+    // adds the tree to the table, and returns the index of its root
+    int compact(CompactTable &table);
+    // makes the tree the one rooted at node root of the table, evaluated from the layout of the table,
+    // which holds the roots of the trees in order
+    void setRoot(CompactTable &table, int tree, int root);
+    void saveCompact(CompactTable &table, std::ofstream &out);
+    // with data, features are translated from the ids in its feature file, as in load()
+    void loadCompact(CompactTable &table, int nNodes, std::ifstream &in, Data *data = NULL);
 
     void findUsedFeatures(std::vector<bool> &features) {
         _root.findUsedFeatures(features);
     }
+
+    int maxFeature() { return _root.maxFeature(); }
 };
 
 #endif	/* TREE_H */
@@ -16,41 +16,89 @@
 
 
 #include "ClassificationForest.h"
+#include "DenseData.h"
+#include "SparseData.h"
 #include <boost/thread.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/random.hpp>
 #include <ctime>
+#include <cmath>
 
-void ClassificationForest::evaluate(int uid, std::vector<double> &prob) {
+// the vote is decided when the remaining trees can't overturn the leading class, or, with a
+// confidence, when a random walk of cnt votes reaches the margin between the two leading classes
+// with probability of at most 1 - confidence (Hoeffding bound)
+bool ClassificationForest::decided(const std::vector<double> &votes, int cnt, int remaining) {
+    double first = 0, second = 0;
+    for (size_t i = 0; i < votes.size(); i++) {
+        if (votes[i] > first) {
+            second = first;
+            first = votes[i];
+        } else if (votes[i] > second) {
+            second = votes[i];
+        }
+    }
+    double margin = first - second;
+    if (margin > remaining)
+        return true;
+
+    return _confidence > 0 && margin * margin >= -2 * cnt * log(1 - _confidence);
+}
+
+template <class D>
+long ClassificationForest::evaluate(D &data, int start, int end, std::vector<std::vector<double> > &prob) {
+    long treesEvaluated = 0;
+    for (int uid = start; uid < end; uid++)
+        treesEvaluated += evaluate(data, uid, prob[uid]);
+    return treesEvaluated;
+}
+
+template <class D>
+int ClassificationForest::evaluate(D &data, int uid, std::vector<double> &prob) {
     prob.clear();
-    prob.resize(_nClasses);
+    prob.resize(_nClasses * _nLabels);
+    std::vector<int> v(_nLabels);
     int cnt = 0;
-    for (size_t i = 0; i < _forest.size(); i++) {
-        int v;
-        ((DecisionTree *)_forest[i])->evaluate(*_data, uid, &v);
-        assert(v < _nClasses);
+    size_t i = 0;
+    while (i < _forest.size()) {
+        ((DecisionTree *)_forest[i])->evaluate(data, uid, &v[0]);
+        i++;
 
-        if (v >= 0) {
-            prob[v]++;
+        // a leaf without users has no class for any of the labels
+        if (v[0] >= 0) {
+            for (int l = 0; l < _nLabels; l++) {
+                assert(v[l] < _nClasses);
+                prob[l * _nClasses + v[l]]++;
+            }
             cnt++;
         }
+        if (_earlyExit && _nLabels == 1 && decided(prob, cnt, _forest.size() - i))
+            break;
     }
 
     for (size_t i = 0; i < prob.size(); i++) {
         prob[i] = prob[i] / cnt;
     }
+    return i;
+}
+
+template <class D>
+void ClassificationForest::evaluate(D &data, int start, int end, std::vector<std::vector<double> > &prob, std::vector<int> &permutation, int feature) {
+    for (int uid = start; uid < end; uid++)
+        evaluate(data, uid, prob[uid], permutation, feature);
 }
 
-void ClassificationForest::evaluate(int uid, std::vector<double> &prob, std::vector<int> &permutation, int feature) {
+template <class D>
+void ClassificationForest::evaluate(D &data, int uid, std::vector<double> &prob, std::vector<int> &permutation, int feature) {
     prob.clear();
-    prob.resize(_nClasses);
+    prob.resize(_nClasses * _nLabels);
+    std::vector<int> v(_nLabels);
     int cnt = 0;
     for (size_t i = 0; i < _forest.size(); i++) {
-        int v;
-        if (((DecisionTree *)_forest[i])->evaluateOOB(*_data, uid, permutation, feature, &v)) {
-            assert(v < _nClasses);
-            if (v >= 0)
-                prob[v]++;
+        if (((DecisionTree *)_forest[i])->evaluateOOB(data, uid, permutation, feature, &v[0])) {
+            for (int l = 0; l < _nLabels && v[0] >= 0; l++) {
+                assert(v[l] < _nClasses);
+                prob[l * _nClasses + v[l]]++;
+            }
             cnt++;
         }
     }
@@ -61,6 +109,9 @@ void ClassificationForest::evaluate(int uid, std::vector<double> &prob, std::vec
 }
 
 void ClassificationForest::evaluateThread(std::vector<std::vector<double> > *prob) {
+    DenseData *dense = dynamic_cast<DenseData *>(_data);
+    SparseData *sparse = dynamic_cast<SparseData *>(_data);
+    long treesEvaluated = 0;
     bool done = false;
     while (!done) {
         int start, end;
@@ -74,12 +125,21 @@ void ClassificationForest::evaluateThread(std::vector<std::vector<double> > *pro
             }
             _counter = end;
         }
-        for (int uid = start; uid < end; uid++)
-	    evaluate(uid, prob->at(uid));
+        if (dense)
+            treesEvaluated += evaluate(*dense, start, end, *prob);
+        else if (sparse)
+            treesEvaluated += evaluate(*sparse, start, end, *prob);
+        else
+            treesEvaluated += evaluate(*_data, start, end, *prob);
     }
+
+    boost::interprocess::scoped_lock<boost::mutex> lock(_mtx);
+    _treesEvaluated += treesEvaluated;
 }
 
 void ClassificationForest::evaluateOOBThread(std::vector<std::vector<double> > *prob, std::vector<int> *permutation, int feature) {
+    DenseData *dense = dynamic_cast<DenseData *>(_data);
+    SparseData *sparse = dynamic_cast<SparseData *>(_data);
     bool done = false;
     while (!done) {
         int start, end;
@@ -93,14 +153,19 @@ void ClassificationForest::evaluateOOBThread(std::vector<std::vector<double> > *
             }
             _counter = end;
         }
-        for (int uid = start; uid < end; uid++) 
-	    evaluate(uid, prob->at(uid), *permutation, feature);
+        if (dense)
+            evaluate(*dense, start, end, *prob, *permutation, feature);
+        else if (sparse)
+            evaluate(*sparse, start, end, *prob, *permutation, feature);
+        else
+            evaluate(*_data, start, end, *prob, *permutation, feature);
     }    
 }
 
 void ClassificationForest::evaluate(std::vector<std::vector<double> > &prob) {  
     boost::thread_group pool;
     _counter = 0;
+    _treesEvaluated = 0;
     _increment = 10;
         
     for (int i = 0; i < _nThreads; i++) {
@@ -24,11 +24,44 @@
 #include <set>
 #include <algorithm>
 
-void Data::filterFeatures(std::string filename) {
+void Data::projectFeatures(const std::vector<int> &features) {
+    _projected = true;
+    _originalFeatures = features;
+    std::sort(_originalFeatures.begin(), _originalFeatures.end());
+    _originalFeatures.erase(std::unique(_originalFeatures.begin(), _originalFeatures.end()), _originalFeatures.end());
+}
+
+void Data::projectColumns(int nColumns, std::vector<int> &columns) {
+    _nOriginalFeatures = nColumns;
+    columns.resize(nColumns);
+    if (_projected) {
+        if (!_originalFeatures.empty() && (_originalFeatures.front() < 0 || _originalFeatures.back() >= nColumns))
+            throw std::runtime_error ("Feature filter lists features that are not in the feature file");
+        std::fill(columns.begin(), columns.end(), -1);
+        for (size_t f = 0; f < _originalFeatures.size(); f++)
+            columns[_originalFeatures[f]] = f;
+        _nFeatures = _originalFeatures.size();
+    } else {
+        for (int f = 0; f < nColumns; f++)
+            columns[f] = f;
+        _nFeatures = nColumns;
+    }
+    _featureList.resize(_nFeatures);
+    for (size_t f = 0; f < _nFeatures; f++)
+        _featureList[f] = f;
+}
+
+int Data::projectedFeature(int original) {
+    if (!_projected)
+        return original;
+    std::vector<int>::iterator it = std::lower_bound(_originalFeatures.begin(), _originalFeatures.end(), original);
+    return it != _originalFeatures.end() && *it == original ? it - _originalFeatures.begin() : -1;
+}
+
+void Data::readFeatureFilter(std::string filename, std::vector<int> &features) {
     FILE *file = fopen(filename.c_str(), "r");
     if (!file) {
-        std::cerr << "could not open file " << filename << std::endl;
-        exit(1);
+        throw std::runtime_error("could not open file " + filename);
     }
     MM_typecode typecode;
 
@@ -66,11 +99,11 @@ void Data::filterFeatures(std::string filename) {
                 err = "Unexpected return value from mm_read_mtx_crd_size";
         }
         throw std::runtime_error (err);
-    } else if (M > (int) _nFeatures || N != 1) {
+    } else if (N != 1) {
         throw std::runtime_error ("Feature filter size does not match features. It must be rows X 1, and rows must be less than or equal number of features");
     }
 
-    _featureList.resize(M);
+    features.resize(M);
     
     for (size_t idx = 0; idx < M; idx++) {
         int v;
@@ -80,15 +113,14 @@ void Data::filterFeatures(std::string filename) {
         if (v < 0) 
             throw std::runtime_error ("target mast be a non-negative integer");
         
-        _featureList[idx] = v;
+        features[idx] = v;
     }
 }
 
 void Data::loadClassificationY(std::string filename) {
     FILE *file = fopen(filename.c_str(), "r");
     if (!file) {
-        std::cerr << "could not open file " << filename << std::endl;
-        exit(1);
+        throw std::runtime_error("could not open file " + filename);
     }
     MM_typecode typecode;
 
@@ -126,14 +158,16 @@ void Data::loadClassificationY(std::string filename) {
                 err = "Unexpected return value from mm_read_mtx_crd_size";
         }
         throw std::runtime_error (err);
-    } else if (M != (int) _nUsers || N != 1) {
-        throw std::runtime_error ("Target size does not match features. It must be rows X 1");
+    } else if (N < 1) {
+        throw std::runtime_error ("Target size does not match features. It must be rows X labels");
     }
 
-    _classificationY.resize(_nUsers);
+    // one column per label, in the same column major order as the file
+    _nLabels = N;
+    _classificationY.resize((size_t) M * _nLabels);
     std::set<int> classes;
     
-    for (size_t idx = 0; idx < _nUsers; idx++) {
+    for (size_t idx = 0; idx < _classificationY.size(); idx++) {
         int v;
         rc = fscanf(file, "%d", &v);
         if (rc < 1)
@@ -145,20 +179,20 @@ void Data::loadClassificationY(std::string filename) {
         classes.insert(v);
     }
     
+    // the labels share the classes 0 ... max, which a single label must all use
     std::vector<int> vec;
     vec.insert(vec.begin(), classes.begin(), classes.end());
     std::sort(vec.begin(), vec.end());
-    if (vec[0] != 0 || vec[vec.size()-1] != vec.size()-1)
+    if (_nLabels == 1 && (vec[0] != 0 || vec[vec.size()-1] != vec.size()-1))
         throw std::runtime_error ("targets must follow sequential integers, starting with 0");
     
-    _nClasses = vec.size();
+    _nClasses = vec[vec.size()-1] + 1;
 }
 
 void Data::loadRegressionY(std::string filename) {
     FILE *file = fopen(filename.c_str(), "r");
     if (!file) {
-        std::cerr << "could not open file " << filename << std::endl;
-        exit(1);
+        throw std::runtime_error("could not open file " + filename);
     }
     MM_typecode typecode;
 
@@ -196,13 +230,15 @@ void Data::loadRegressionY(std::string filename) {
                 err = "Unexpected return value from mm_read_mtx_crd_size";
         }
         throw std::runtime_error (err);
-    } else if (M != (int) _nUsers || N != 1) {
-        throw std::runtime_error ("Target size does not match features. It must be rows X 1");
+    } else if (N < 1) {
+        throw std::runtime_error ("Target size does not match features. It must be rows X targets");
     }
 
-    _regressionY.resize(_nUsers);
+    // one column per target, in the same column major order as the file
+    _nTargets = N;
+    _regressionY.resize((size_t) M * _nTargets);
     
-    for (size_t idx = 0; idx < _nUsers; idx++) {
+    for (size_t idx = 0; idx < _regressionY.size(); idx++) {
         double v;
         rc = fscanf(file, "%lf", &v);
         if (rc < 1)
@@ -212,6 +248,13 @@ void Data::loadRegressionY(std::string filename) {
     }
 }
 
+void Data::checkTargets() {
+    if (!_classificationY.empty() && _classificationY.size() != _nUsers * _nLabels)
+        throw std::runtime_error ("Target size does not match features. It must be rows X labels");
+    if (!_regressionY.empty() && _regressionY.size() != _nUsers * _nTargets)
+        throw std::runtime_error ("Target size does not match features. It must be rows X targets");
+}
+
 // creates a subset that includes the entire data set
 DataSubset Data::createSubset() {
     return DataSubset(this);
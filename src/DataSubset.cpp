@@ -65,28 +65,34 @@ DataSubset::DataSubset(Data *data) {
         _userIndeces.push_back(i);
 }
 
-DataSubset::DataSubset(Data *data, const std::vector<int> &indeces) {
+DataSubset::DataSubset(Data *data, const std::vector<int> &indeces, bool sorted) {
     _data = data;
     std::vector<int> tmp(indeces);
     _userIndeces.swap(tmp);
-    std::sort(_userIndeces.begin(), _userIndeces.end());        
+    if (!sorted)
+        std::sort(_userIndeces.begin(), _userIndeces.end());        
 }
 
-std::vector<int> DataSubset::getSomeFeatures(int nFeatures) {
-    static boost::mt19937 rng(std::time(0));
-    
+std::vector<int> DataSubset::getSomeFeatures(int nFeatures, boost::mt19937 &rng) {
     std::vector<int> tmp(_data->_featureList);
-    DataSubset::permute(tmp);
+    DataSubset::shuffle(tmp, rng);
     
     tmp.resize(nFeatures);
     return tmp;    
 }
 
 void DataSubset::permute(std::vector<int> &tmp) {
-    static boost::mt19937 rng(std::time(0));
-    
     for (size_t i = 0; i < tmp.size(); i++)
         tmp[i] = i;
+    shuffle(tmp);
+}
+
+void DataSubset::shuffle(std::vector<int> &tmp) {
+    static boost::mt19937 rng(std::time(0));
+    shuffle(tmp, rng);
+}
+
+void DataSubset::shuffle(std::vector<int> &tmp, boost::mt19937 &rng) {
     for (size_t i = 0; i < tmp.size(); i++) {
         boost::uniform_int<> swap(i, tmp.size()-1);
         int r = swap(rng);   
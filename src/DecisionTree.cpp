@@ -16,26 +16,36 @@
 
 
 #include "DecisionTree.h"
+#include "RadixSort.h"
 #include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <stdexcept>
 
-DecisionTree::DecisionTree() : Tree() {
+DecisionTree::DecisionTree(int nLabels) : Tree(), _nLabels(nLabels) {
+    clearValues();
 }
 
-bool DecisionTree::isSingleClass(DataSubset &data, const std::vector<int> &users) {
-    int cls = data.classificationY(users[0]);
+void DecisionTree::clearValues() {
+    if (_nLabels > 1) {
+        _outputs.assign(_nLabels, -1);
+        _empty._cls = 0;
+    }
+}
+
+bool DecisionTree::isSingleClass(DataSubset &data, const std::vector<int> &users, int label) {
+    int cls = data.classificationY(users[0], label);
     for (size_t i = 1; i < users.size(); i++)
-        if (data.classificationY(users[i]) != cls)
+        if (data.classificationY(users[i], label) != cls)
             return false;
 
     return true;
 }
 
-int DecisionTree::mostPopularClass(DataSubset &data, const std::vector<int> &users) {
+int DecisionTree::mostPopularClass(DataSubset &data, const std::vector<int> &users, int label) {
     std::vector<int> classes(data.nClasses());
     for (size_t i = 0; i < users.size(); i++)
-        classes[data.classificationY(users[i])] += 1;
+        classes[data.classificationY(users[i], label)] += 1;
 
     int mx = classes[0];
     int idx = 0;
@@ -48,9 +58,27 @@ int DecisionTree::mostPopularClass(DataSubset &data, const std::vector<int> &use
     return idx;
 }
 
+// appends the most popular class of every label to _outputs, all -1 without users, and
+// returns the index of the leaf
+int DecisionTree::mostPopularClasses(DataSubset &data, const std::vector<int> &users) {
+    int leaf = _outputs.size() / _nLabels;
+    for (int l = 0; l < _nLabels; l++)
+        _outputs.push_back(users.empty() ? -1 : mostPopularClass(data, users, l));
+    return leaf;
+}
+
 bool DecisionTree::checkAndMakeLeaf(DataSubset &data, const std::vector<int> &userIndeces, Node *node, int depth, bool forceLeaf) {
     node->_isLeaf = false;
-    if (userIndeces.size() == 0) {
+    if (_nLabels > 1) {
+        // a node is split until its users agree on every label
+        bool single = true;
+        for (int l = 0; l < _nLabels && single && !userIndeces.empty(); l++)
+            single = isSingleClass(data, userIndeces, l);
+        if (single || forceLeaf || (_maxDepth > 0 && depth >= _maxDepth) || userIndeces.size() < _minSplit) {
+            node->_isLeaf = true;
+            node->_cls = mostPopularClasses(data, userIndeces);
+        }
+    } else if (userIndeces.size() == 0) {
         node->_isLeaf = true;
         node->_cls = -1;
     } else if (isSingleClass(data, userIndeces)) {
@@ -63,39 +91,27 @@ bool DecisionTree::checkAndMakeLeaf(DataSubset &data, const std::vector<int> &us
     return node->_isLeaf;
 }
 
-void DecisionTree::bestThreshold(DataSubset &data, int feature, double &bestGini, double &bestSplit) {
-    DataSubsetIterator users(data, feature);
+void DecisionTree::bestThreshold(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &bestGini, double &bestSplit) {
+    if (_nLabels > 1) {
+        bestThresholdLabels(data, noValue, values, users, bestGini, bestSplit);
+        return;
+    }
 
     std::vector<double> noValueCounts(data.nClasses());
     std::vector<double> moreThan(data.nClasses());
     std::vector<double> lessThan(data.nClasses());
-    std::vector<std::pair<double, int> > values;
-    values.reserve(users.size());
 
     // figure out the counts for the no-values split
     // figure out the counts for each class
-
-    const std::vector<int> &userIndeces = data.getUsers();
-    size_t u = 0;
-    while (u < userIndeces.size()) {
-        assert(!users.hasNext() || users.index() >= userIndeces[u]);
-        while (u < userIndeces.size() && (!users.hasNext() || users.index() > userIndeces[u])) {
-            noValueCounts[data.classificationY(userIndeces[u])] += 1;
-            u++;
-        }
-        while (users.hasNext() && u < userIndeces.size() && users.index() == userIndeces[u]) {
-            int t = data.classificationY(users.index());
-            values.push_back(std::pair<double, int>(users.value(), t));
-            moreThan[t] += 1;
-            users.next();
-            u++;
-        }
-    }
+    for (size_t i = 0; i < noValue.size(); i++)
+        noValueCounts[data.classificationY(noValue[i])] += 1;
+    for (size_t i = 0; i < users.size(); i++)
+        moreThan[data.classificationY(users[i])] += 1;
 
     // compute the gini index for the no-value set
     double gNoValue = 0;
     double Nnv = 0;
-    double N = data.nUsers();
+    double N = noValue.size() + values.size();
     for (size_t i = 0; i < noValueCounts.size(); ++i) {
         Nnv += noValueCounts[i];
         gNoValue += noValueCounts[i] * noValueCounts[i];
@@ -110,13 +126,14 @@ void DecisionTree::bestThreshold(DataSubset &data, int feature, double &bestGini
         return;
     }
     
-    // sort the values
+    // sort the values, order maps them back to their users
     // we are starting with "everything is bigger than alpha"
-    std::sort(values.begin(), values.end());
+    std::vector<unsigned int> order;
+    radixSort(values, order);
     int nMore = users.size();
     int nLess = 0;
-    double split = values[0].first - 1;
-    double maxVal = values[values.size() - 1].first;
+    double split = values[0] - 1;
+    double maxVal = values[values.size() - 1];
     size_t index = 0;
 
     double gini = 0;
@@ -134,16 +151,17 @@ void DecisionTree::bestThreshold(DataSubset &data, int feature, double &bestGini
     // walk the sorted values, and compute the gini value. keep track of the minimum
     while (split < maxVal) {
         // find the next split value
-        split = values[index].first;
-        while (index < values.size() && values[index].first <= split) {
-            moreThan[values[index].second]--;
+        split = values[index];
+        while (index < values.size() && values[index] <= split) {
+            int t = data.classificationY(users[order[index]]);
+            moreThan[t]--;
             nMore--;
-            lessThan[values[index].second]++;
+            lessThan[t]++;
             nLess++;
             index++;
         }
         if (index < values.size()) {
-            split = index >= values.size() ? values[index - 1].first + 1 : (values[index - 1].first + values[index].first) / 2;
+            split = index >= values.size() ? values[index - 1] + 1 : (values[index - 1] + values[index]) / 2;
 
             double giniLess = 0;
             double giniMore = 0;
@@ -169,10 +187,113 @@ void DecisionTree::bestThreshold(DataSubset &data, int feature, double &bestGini
     bestGini += gNoValue;
 }
 
+// n - sum(c^2) / n for class counts c summing to n, 0 for no users
+static double impurity(const double *counts, size_t nClasses) {
+    double n = 0, sum2 = 0;
+    for (size_t i = 0; i < nClasses; i++) {
+        n += counts[i];
+        sum2 += counts[i] * counts[i];
+    }
+    return n > 0 ? n - sum2 / n : 0;
+}
+
+static double impurity(const std::vector<double> &counts) {
+    return impurity(&counts[0], counts.size());
+}
+
+// the split search with several labels: the gini indices of all the labels are added up,
+// at every position of the one sort of the values. counts are [label * nClasses + class]
+void DecisionTree::bestThresholdLabels(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &bestGini, double &bestSplit) {
+    int nClasses = data.nClasses();
+    std::vector<double> noValueCounts(_nLabels * nClasses);
+    std::vector<double> moreThan(_nLabels * nClasses);
+    std::vector<double> lessThan(_nLabels * nClasses);
+    double N = noValue.size() + values.size();
+
+    for (size_t i = 0; i < noValue.size(); i++)
+        for (int l = 0; l < _nLabels; l++)
+            noValueCounts[l * nClasses + data.classificationY(noValue[i], l)] += 1;
+    double gNoValue = 0;
+    for (int l = 0; l < _nLabels; l++)
+        gNoValue += impurity(&noValueCounts[l * nClasses], nClasses) / N;
+
+    if (values.size() == 0) {
+        bestGini = gNoValue;
+        bestSplit = 0;
+        return;
+    }
+
+    std::vector<unsigned int> order;
+    radixSort(values, order);
+    for (size_t i = 0; i < users.size(); i++)
+        for (int l = 0; l < _nLabels; l++)
+            moreThan[l * nClasses + data.classificationY(users[i], l)] += 1;
+
+    // we are starting with "everything is bigger than alpha"
+    double gini = 0;
+    for (int l = 0; l < _nLabels; l++)
+        gini += impurity(&moreThan[l * nClasses], nClasses);
+    bestGini = gini / N;
+    bestSplit = values[0] - 1;
+
+    // walk the sorted values, moving the users of each distinct value to lessThan
+    size_t index = 0;
+    while (index < values.size()) {
+        double value = values[index];
+        while (index < values.size() && values[index] <= value) {
+            int u = users[order[index]];
+            for (int l = 0; l < _nLabels; l++) {
+                int t = l * nClasses + data.classificationY(u, l);
+                moreThan[t]--;
+                lessThan[t]++;
+            }
+            index++;
+        }
+        if (index < values.size()) {
+            gini = 0;
+            for (int l = 0; l < _nLabels; l++)
+                gini += impurity(&lessThan[l * nClasses], nClasses) + impurity(&moreThan[l * nClasses], nClasses);
+            if (gini / N < bestGini) {
+                bestGini = gini / N;
+                bestSplit = (values[index - 1] + values[index]) / 2;
+            }
+        }
+    }
+
+    bestGini += gNoValue;
+}
+
+double DecisionTree::scoreThreshold(DataSubset &data, const std::vector<int> &noValue, const std::vector<double> &values, const std::vector<int> &users, double threshold) {
+    std::vector<double> noValueCounts(data.nClasses());
+    std::vector<double> moreThan(data.nClasses());
+    std::vector<double> lessThan(data.nClasses());
+
+    // with several labels, their impurities are added up
+    double score = 0;
+    for (int l = 0; l < _nLabels; l++) {
+        std::fill(noValueCounts.begin(), noValueCounts.end(), 0);
+        std::fill(moreThan.begin(), moreThan.end(), 0);
+        std::fill(lessThan.begin(), lessThan.end(), 0);
+        for (size_t i = 0; i < noValue.size(); i++)
+            noValueCounts[data.classificationY(noValue[i], l)] += 1;
+        for (size_t i = 0; i < values.size(); i++) {
+            int t = data.classificationY(users[i], l);
+            if (values[i] < threshold)
+                lessThan[t] += 1;
+            else
+                moreThan[t] += 1;
+        }
+        score += impurity(noValueCounts) + impurity(lessThan) + impurity(moreThan);
+    }
+
+    double N = noValue.size() + values.size();
+    return score / N;
+}
+
 void DecisionTree::evaluate(Data &data, int uid, int *out) {
     Node *node = getNode(data, uid);
  
-    *out = node->_cls;
+    copyClasses(node, out);
     
     }
 
@@ -184,7 +305,7 @@ bool DecisionTree::evaluateOOB (Data &data, int uid, std::vector<int> &permutati
         return false;
     }
     
-    *out = node->_cls;
+    copyClasses(node, out);
     return true;
 }
 
@@ -193,28 +314,66 @@ void DecisionTree::load(Node *node, std::ifstream &in) {
     node->_greaterThan = NULL;
     node->_lessThan = NULL;
 
-    in >> node->_isLeaf >>
-            node->_cls >>
-            node->_threshold >>
+    // with several labels, a leaf has a class for each of them
+    int kind;
+    in >> kind;
+    if (kind == LEAF && _nLabels > 1) {
+        node->_cls = _outputs.size() / _nLabels;
+        for (int l = 0; l < _nLabels; l++) {
+            int c;
+            in >> c;
+            _outputs.push_back(c);
+        }
+    } else {
+        in >> node->_cls;
+    }
+    in >> node->_threshold >>
             node->_feature; 
+    // stop at a truncated file, rather than reading children forever
+    if (in.fail())
+        kind = LEAF;
+    node->_isLeaf = kind == LEAF;
+    if (!node->_isLeaf)
+        node->_feature = loadedFeature(node->_feature);
         
     if (!node->_isLeaf) {
-        node->_noValue = new Node;
-        load(node->_noValue, in);        
-        node->_greaterThan = new Node;
+        if (kind != BINARY) {
+            node->_noValue = _nodes.allocate();
+            load(node->_noValue, in);        
+        }
+        node->_greaterThan = _nodes.allocate();
         load(node->_greaterThan, in);        
-        node->_lessThan = new Node;
+        node->_lessThan = _nodes.allocate();
         load(node->_lessThan, in);        
     }
 }
 
+void DecisionTree::saveValue(Node *node, std::ostream &out) {
+    if (_nLabels > 1)
+        throw std::runtime_error("compacted forests support a single classification label");
+    out << node->_cls;
+}
+
+void DecisionTree::loadValue(Node *node, std::istream &in) {
+    in >> node->_cls;
+}
+
 void DecisionTree::save(Node *node, std::ofstream &out) {
     assert(!node->_isLeaf || (node->_noValue == NULL && node->_greaterThan == NULL && node->_lessThan == NULL));
-    assert(node->_isLeaf || (node->_noValue != NULL && node->_greaterThan != NULL && node->_lessThan != NULL));
+    assert(node->_isLeaf || (node->_greaterThan != NULL && node->_lessThan != NULL));
     
-    out << node->_isLeaf << " " << node->_cls << " " << node->_threshold << " " << node->_feature << std::endl;    
+    int kind = node->_isLeaf ? LEAF : node->_noValue ? INTERNAL : BINARY;
+    out << kind << " ";
+    if (node->_isLeaf && _nLabels > 1) {
+        for (int l = 0; l < _nLabels; l++)
+            out << _outputs[node->_cls * _nLabels + l] << " ";
+    } else {
+        out << node->_cls << " ";
+    }
+    out << node->_threshold << " " << savedFeature(node) << std::endl;    
     if (!node->_isLeaf) {
-        save(node->_noValue, out);
+        if (node->_noValue)
+            save(node->_noValue, out);
         save(node->_greaterThan, out);
         save(node->_lessThan, out);
     }
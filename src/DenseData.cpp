@@ -70,37 +70,59 @@ void DenseData::loadFeatures(std::string filename) {
         throw std::runtime_error (err);
     }
     
-    _nFeatures = N;
     _nUsers = M;
-    _featureList.resize(_nFeatures);
-    for (int idx = 0; idx < _nFeatures; ++idx) {
-        _featureList[idx]=idx;
-    }
+    std::vector<int> columns;
+    projectColumns(N, columns);
 
-    _features.resize(_nFeatures);
+    if (_rowMajor)
+        _rows.resize(_nUsers * _nFeatures);
+    else
+        _features.resize(_nFeatures);
     
-    for (size_t f = 0; f < _nFeatures; f++) {
-        _features[f].resize(_nUsers);
+    // the file is in column major order. the values of dropped features are read and discarded
+    for (int original = 0; original < N; original++) {
+        int f = columns[original];
+        if (f >= 0 && !_rowMajor)
+            _features[f].resize(_nUsers);
         for (size_t u = 0; u < _nUsers; u++) {
             double v;
             rc = fscanf(file, "%lf", &v);
             if (rc < 1)
                 throw std::runtime_error ("Unexpected error while reading the input file");
                     
-            _features[f][u] = v;
+            if (f < 0)
+                continue;
+            if (_rowMajor)
+                _rows[u * _nFeatures + f] = v;
+            else
+                _features[f][u] = v;
         }
     }
 }
 
+void DenseData::loadRows(std::vector<double> &rows, int nFeatures) {
+    _rowMajor = true;
+    _nFeatures = nFeatures;
+    _nUsers = nFeatures > 0 ? rows.size() / nFeatures : 0;
+    _rows.swap(rows);
+    _features.clear();
+    _featureList.resize(_nFeatures);
+    for (int idx = 0; idx < nFeatures; ++idx) {
+        _featureList[idx] = idx;
+    }
+}
+
 bool DenseData::at(int u, int f, double &v) {
-    v = _features[f][u];
-    return true;
+    return get(u, f, v);
 }
 
 void DenseData::iterator(DataSubsetIterator *iter, int feature, std::vector<int> &indeces) {
+    if (_rowMajor)
+        throw std::runtime_error("dense data loaded row major for evaluation cannot be iterated by feature");
     // dense data set, so use all the indeces.
     iter->_rows = NULL;
-    iter->_vals = & (_features[feature]);
+    iter->_sparse = false;
+    iter->_vals = _features[feature].empty() ? NULL : &_features[feature][0];
     std::vector<int> tmp(indeces);
     iter->_indeces.swap(tmp);
     iter->_idx = 0;
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2014 Ofer Shai
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "PredictionWriter.h"
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+
+// number of values formatted by all the threads between writes
+#define TEXT_BLOCK (1 << 20)
+// number of values converted to float between writes
+#define BINARY_BLOCK (1 << 16)
+
+// predictions stored one row after another
+class FlatMatrix {
+public:
+    const std::vector<double> &_values;
+    size_t _nCols;
+
+    FlatMatrix(const std::vector<double> &values, int nCols) : _values(values), _nCols(nCols) {}
+    size_t rows() const { return _nCols > 0 ? _values.size() / _nCols : 0; }
+    size_t cols() const { return _nCols; }
+    double at(size_t row, size_t col) const { return _values[row * _nCols + col]; }
+};
+
+// predictions stored as a vector per row
+class NestedMatrix {
+public:
+    const std::vector<std::vector<double> > &_rows;
+    size_t _nCols;
+
+    NestedMatrix(const std::vector<std::vector<double> > &rows, int nCols) : _rows(rows), _nCols(nCols) {}
+    size_t rows() const { return _rows.size(); }
+    size_t cols() const { return _nCols; }
+    double at(size_t row, size_t col) const { return _rows[row][col]; }
+};
+
+// powers of ten that are exact in extended precision
+static const long double POWERS[] = {
+    1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L,
+    1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L,
+    1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L,
+    1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+};
+
+static long double power10(int n) {
+    return n < (int) (sizeof(POWERS) / sizeof(POWERS[0])) ? POWERS[n] : powl(10, n);
+}
+
+int PredictionWriter::format(double v, char *buf) {
+    // integers, e.g. probabilities of 0 and 1, are common and don't need the general formatting
+    if (v > -1000000 && v < 1000000 && v == (int) v && (v != 0 || 1 / v > 0)) {
+        int n = (int) v, len = 0;
+        char digits[8];
+        if (n < 0) {
+            buf[len++] = '-';
+            n = -n;
+        }
+        int d = 0;
+        do {
+            digits[d++] = '0' + n % 10;
+            n /= 10;
+        } while (n > 0);
+        while (d > 0)
+            buf[len++] = digits[--d];
+        buf[len] = 0;
+        return len;
+    }
+    if (!(fabs(v) > 1e-300 && fabs(v) < 1e300))
+        return snprintf(buf, 32, "%g", v);
+
+    // round to the 6 significant digits of %g. the extended precision scaling is exact enough
+    // to decide the rounding, unless the value is about halfway between two roundings
+    // the decimal exponent from the binary one is either right or one too small
+    long double a = fabsl(v);
+    int b;
+    frexp(v, &b);
+    int e = (int) floor((b - 1) * 0.30102999566398120);
+    long double scaled = e <= 5 ? a * power10(5 - e) : a / power10(e - 5);
+    if (scaled >= 1e6L) {
+        e++;
+        scaled /= 10;
+    } else if (scaled < 1e5L) {
+        e--;
+        scaled *= 10;
+    }
+    long double whole = floorl(scaled);
+    if (fabsl(scaled - whole - 0.5L) < 1e-6L)
+        return snprintf(buf, 32, "%g", v);
+    int digits = (int) whole + (scaled - whole > 0.5L ? 1 : 0);
+    if (digits == 1000000) {
+        digits = 100000;
+        e++;
+    }
+
+    char d[6];
+    for (int i = 5; i >= 0; i--) {
+        d[i] = '0' + digits % 10;
+        digits /= 10;
+    }
+    int last = 5; // the last digit that isn't a trailing zero
+    while (last > 0 && d[last] == '0')
+        last--;
+
+    int len = 0;
+    if (v < 0)
+        buf[len++] = '-';
+    if (e < -4 || e >= 6) {
+        buf[len++] = d[0];
+        if (last > 0) {
+            buf[len++] = '.';
+            for (int i = 1; i <= last; i++)
+                buf[len++] = d[i];
+        }
+        buf[len++] = 'e';
+        buf[len++] = e < 0 ? '-' : '+';
+        int x = e < 0 ? -e : e;
+        if (x >= 100)
+            buf[len++] = '0' + x / 100;
+        buf[len++] = '0' + x / 10 % 10;
+        buf[len++] = '0' + x % 10;
+    } else if (e >= 0) {
+        for (int i = 0; i <= e; i++)
+            buf[len++] = d[i];
+        if (last > e) {
+            buf[len++] = '.';
+            for (int i = e + 1; i <= last; i++)
+                buf[len++] = d[i];
+        }
+    } else {
+        buf[len++] = '0';
+        buf[len++] = '.';
+        for (int i = -1; i > e; i--)
+            buf[len++] = '0';
+        for (int i = 0; i <= last; i++)
+            buf[len++] = d[i];
+    }
+    buf[len] = 0;
+    return len;
+}
+
+// formats the values of col for rows [start, end), a line each
+template <class M>
+static void formatColumn(const M *matrix, size_t col, size_t start, size_t end, std::string *text) {
+    char buf[32];
+    text->clear();
+    text->reserve((end - start) * 10);
+    for (size_t row = start; row < end; row++) {
+        int len = PredictionWriter::format(matrix->at(row, col), buf);
+        buf[len] = '\n';
+        text->append(buf, len + 1);
+    }
+}
+
+template <class M>
+void PredictionWriter::writeText(std::ofstream &out, const M &matrix) {
+    out << "%%MatrixMarket matrix array real general" << std::endl << "%" << std::endl
+            << matrix.rows() << " " << matrix.cols() << std::endl;
+
+    std::vector<std::string> text(_nThreads);
+    for (size_t col = 0; col < matrix.cols(); col++) {
+        for (size_t start = 0; start < matrix.rows(); start += TEXT_BLOCK) {
+            size_t end = std::min(start + TEXT_BLOCK, matrix.rows());
+            size_t share = (end - start + _nThreads - 1) / _nThreads;
+            if (_nThreads == 1) {
+                formatColumn(&matrix, col, start, end, &text[0]);
+            } else {
+                boost::thread_group pool;
+                for (int t = 0; t < _nThreads; t++) {
+                    size_t from = std::min(start + t * share, end), to = std::min(from + share, end);
+                    pool.create_thread(boost::bind(&formatColumn<M>, &matrix, col, from, to, &text[t]));
+                }
+                pool.join_all();
+            }
+            for (int t = 0; t < _nThreads; t++)
+                out.write(text[t].data(), text[t].size());
+        }
+    }
+}
+
+template <class M>
+void PredictionWriter::writeBinary(std::ofstream &out, const M &matrix) {
+    boost::uint64_t rows = matrix.rows();
+    boost::uint32_t cols = matrix.cols();
+    out.write("RFPB", 4);
+    out.write((const char *) &rows, sizeof(rows));
+    out.write((const char *) &cols, sizeof(cols));
+
+    std::vector<float> block;
+    block.reserve(BINARY_BLOCK + cols);
+    for (size_t row = 0; row < matrix.rows(); row++) {
+        for (size_t col = 0; col < cols; col++)
+            block.push_back(matrix.at(row, col));
+        if (!block.empty() && (block.size() >= BINARY_BLOCK || row + 1 == matrix.rows())) {
+            out.write((const char *) &block[0], block.size() * sizeof(float));
+            block.clear();
+        }
+    }
+}
+
+template <class M>
+void PredictionWriter::write(const std::string &filename, const M &matrix) {
+    std::ofstream out(filename.c_str(), _binary ? std::ios::out | std::ios::binary : std::ios::out);
+    if (!out)
+        throw std::runtime_error("could not open " + filename);
+    if (_binary)
+        writeBinary(out, matrix);
+    else
+        writeText(out, matrix);
+    out.close();
+    if (out.fail())
+        throw std::runtime_error("error while writing " + filename);
+}
+
+void PredictionWriter::write(const std::string &filename, const std::vector<double> &values, int nCols) {
+    write(filename, FlatMatrix(values, nCols));
+}
+
+void PredictionWriter::write(const std::string &filename, const std::vector<std::vector<double> > &rows, int nCols) {
+    write(filename, NestedMatrix(rows, nCols));
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2014 Ofer Shai
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "RadixSort.h"
+#include <boost/thread/tss.hpp>
+#include <boost/cstdint.hpp>
+#include <algorithm>
+#include <cstring>
+
+// below these sizes, the histograms and passes of the radix sort cost more than comparing
+#define INSERTION_SORT_SIZE 32
+#define COMPARISON_SORT_SIZE 2048
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+static const boost::uint64_t SIGN = 1ULL << 63;
+
+class RadixScratch {
+public:
+    std::vector<boost::uint64_t> _keys[2];
+    std::vector<unsigned int> _order;
+};
+
+static boost::thread_specific_ptr<RadixScratch> scratch;
+
+// maps a double to an unsigned integer with the same order: positive values get the sign
+// bit set, negative values are flipped entirely
+static inline boost::uint64_t encode(double v) {
+    boost::uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (bits & SIGN) ? ~bits : bits | SIGN;
+}
+
+static inline double decode(boost::uint64_t bits) {
+    bits = (bits & SIGN) ? bits & ~SIGN : ~bits;
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+static void insertionSort(std::vector<double> &values, std::vector<unsigned int> &order) {
+    for (size_t i = 0; i < values.size(); i++)
+        order[i] = i;
+    for (size_t i = 1; i < values.size(); i++) {
+        double v = values[i];
+        unsigned int o = order[i];
+        size_t j = i;
+        for (; j > 0 && values[j - 1] > v; j--) {
+            values[j] = values[j - 1];
+            order[j] = order[j - 1];
+        }
+        values[j] = v;
+        order[j] = o;
+    }
+}
+
+// the original position breaks ties, so this is stable as well
+static void comparisonSort(std::vector<double> &values, std::vector<unsigned int> &order) {
+    std::vector<std::pair<double, unsigned int> > pairs(values.size());
+    for (size_t i = 0; i < values.size(); i++)
+        pairs[i] = std::pair<double, unsigned int>(values[i], i);
+    std::sort(pairs.begin(), pairs.end());
+    for (size_t i = 0; i < values.size(); i++) {
+        values[i] = pairs[i].first;
+        order[i] = pairs[i].second;
+    }
+}
+
+void radixSort(std::vector<double> &values, std::vector<unsigned int> &order) {
+    size_t n = values.size();
+    order.resize(n);
+    if (n < INSERTION_SORT_SIZE) {
+        insertionSort(values, order);
+        return;
+    }
+    if (n < COMPARISON_SORT_SIZE) {
+        comparisonSort(values, order);
+        return;
+    }
+
+    RadixScratch *s = scratch.get();
+    if (!s) {
+        s = new RadixScratch;
+        scratch.reset(s);
+    }
+    s->_keys[0].resize(n);
+    s->_keys[1].resize(n);
+    s->_order.resize(n);
+
+    // histograms of all the digits in a single pass
+    unsigned int counts[RADIX_PASSES][RADIX_BUCKETS];
+    memset(counts, 0, sizeof(counts));
+    boost::uint64_t *keys = &s->_keys[0][0];
+    for (size_t i = 0; i < n; i++) {
+        boost::uint64_t k = encode(values[i]);
+        keys[i] = k;
+        order[i] = i;
+        for (int p = 0; p < RADIX_PASSES; p++)
+            counts[p][(k >> (p * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+    }
+
+    boost::uint64_t *keysOut = &s->_keys[1][0];
+    unsigned int *orderIn = &order[0], *orderOut = &s->_order[0];
+    for (int p = 0; p < RADIX_PASSES; p++) {
+        int shift = p * RADIX_BITS;
+        // a digit that is the same for all the keys doesn't change the order
+        if (counts[p][(keys[0] >> shift) & (RADIX_BUCKETS - 1)] == n)
+            continue;
+
+        unsigned int offsets[RADIX_BUCKETS];
+        unsigned int total = 0;
+        for (int b = 0; b < RADIX_BUCKETS; b++) {
+            offsets[b] = total;
+            total += counts[p][b];
+        }
+        for (size_t i = 0; i < n; i++) {
+            unsigned int &o = offsets[(keys[i] >> shift) & (RADIX_BUCKETS - 1)];
+            keysOut[o] = keys[i];
+            orderOut[o] = orderIn[i];
+            o++;
+        }
+        std::swap(keys, keysOut);
+        std::swap(orderIn, orderOut);
+    }
+
+    for (size_t i = 0; i < n; i++)
+        values[i] = decode(keys[i]);
+    if (orderIn != &order[0])
+        memcpy(&order[0], orderIn, n * sizeof(unsigned int));
+}
@@ -20,13 +20,18 @@
 #include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/random.hpp>
 #include <ctime>
+#include <cstdio>
+#include <stdexcept>
+#include <set>
+#include <sstream>
+#include <algorithm>
 
-void RandomForest::trainTrees(int seed) {
+void RandomForest::trainTrees() {
     int startTime = time(NULL);
     int tree;
-    boost::mt19937 rnd(seed);
     DataSubset ds = _data->createSubset();
     boost::uniform_int<> bagging(0, ds.nUsers() - 1);    
+    int nBag = std::max(1, std::min(ds.nUsers(), (int) (_bagFraction * ds.nUsers() + 0.5)));
     
     while (true) {
         {
@@ -44,14 +49,45 @@ void RandomForest::trainTrees(int seed) {
             }
 
         }
-        std::vector<int> indeces(ds.nUsers());
-        for (size_t i = 0; i < indeces.size(); i++) {            
-            indeces[i] = bagging(rnd);
+        // each tree has its own seed, so a resumed training draws the same bags
+        boost::mt19937 rnd(_seeds[tree]);
+        std::vector<int> indeces;
+        bool sorted = true;
+        if (!_bootstrap) {
+            indeces.resize(ds.nUsers());
+            for (size_t i = 0; i < indeces.size(); i++)
+                indeces[i] = i;
+        } else if (_replacement) {
+            indeces.resize(nBag);
+            for (size_t i = 0; i < indeces.size(); i++) {            
+                indeces[i] = bagging(rnd);
+            }
+            sorted = false;
+        } else {
+            // selection sampling: each user is taken with probability (still needed) / (still left),
+            // which draws exactly nBag users, in increasing order
+            boost::uniform_01<> uniform;
+            indeces.reserve(nBag);
+            int needed = nBag;
+            for (int i = 0; i < ds.nUsers() && needed > 0; i++) {
+                if (uniform(rnd) * (ds.nUsers() - i) < needed) {
+                    indeces.push_back(i);
+                    needed--;
+                }
+            }
         }
 
-        DataSubset subset = ds.createSubsetUsers(indeces);     
+        DataSubset subset = ds.createSubsetUsers(indeces, sorted);
         
+        _forest[tree]->setSeed(_seeds[tree]);
         _forest[tree]->train(subset, _nFeatures);
+
+        if (_checkpoint.is_open()) {
+            boost::interprocess::scoped_lock<boost::mutex> lock(_mtx);
+            _finished.push_back(tree);
+            if ((int) _finished.size() >= _checkpointInterval)
+                writeCheckpoint();
+        }
     }
 }
 
@@ -60,25 +96,261 @@ void RandomForest::train() {
     
     std::cout << "Training Random Forest" << std::endl;
 
+    // assign seeds to the trees that are about to be trained, skipping seeds of
+    // trees that were already trained. the seeds of loaded trees aren't saved, so they are
+    // taken to be the ones following _seed, as if the forest was trained with the same seed
+    std::set<int> used(_seeds.begin(), _seeds.end());
+    int first = _seed + (int) (_forest.size() - _seeds.size());
+    _seeds.resize(_forest.size());
+    for (int seed = first; (int) _seeds.size() < _nTrees; seed++) {
+        if (used.find(seed) == used.end())
+            _seeds.push_back(seed);
+    }
+
     for (int i = 0; i < _nThreads; i++) {
-        pool.create_thread(boost::bind(&RandomForest::trainTrees, this, std::time(0) + i));
+        pool.create_thread(boost::bind(&RandomForest::trainTrees, this));
     }
 
     pool.join_all();
     assert(_nTrees == _forest.size());
+
+    if (_checkpoint.is_open())
+        writeCheckpoint();
+}
+
+// the checkpoint starts with a header line, followed by blocks of trees:
+//   checkpoint <seed> <features> <classes>
+//   block <number of trees>
+//   <bagging seed>
+//   <tree>
+//   ...
+//   end
+// a block that was not completely written is ignored when resuming
+void RandomForest::writeCheckpoint() {
+    if (_finished.empty())
+        return;
+
+    _checkpoint << "block " << _finished.size() << std::endl;
+    for (size_t i = 0; i < _finished.size(); i++) {
+        _checkpoint << _seeds[_finished[i]] << std::endl;
+        _forest[_finished[i]]->save(_checkpoint, _data);
+    }
+    _checkpoint << "end" << std::endl;
+    _checkpoint.flush();
+    if (_checkpoint.fail())
+        std::cerr << "Failed writing checkpoint" << std::endl;
+    _finished.clear();
+}
+
+void RandomForest::checkpoint(const std::string &filename, int interval) {
+    // the trees trained so far are written to a temporary file that then replaces the checkpoint,
+    // so the previous checkpoint is kept if writing them fails
+    std::string tmp = filename + ".tmp";
+    _checkpoint.open(tmp.c_str(), std::ios::out | std::ios::trunc);
+    if (!_checkpoint.is_open())
+        throw std::runtime_error("could not open checkpoint file " + tmp);
+
+    _checkpointInterval = interval;
+    _checkpoint << "checkpoint " << _seed << " " << _nFeatures << " ";
+    writeClasses(_checkpoint);
+    _checkpoint << std::endl;
+    for (size_t i = 0; i < _forest.size(); i++)
+        _finished.push_back(i);
+    writeCheckpoint();
+    bool failed = _checkpoint.fail();
+    _checkpoint.close();
+    if (failed || _checkpoint.fail() || std::rename(tmp.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("could not write checkpoint file " + filename);
+
+    _checkpoint.clear();
+    _checkpoint.open(filename.c_str(), std::ios::out | std::ios::app);
+    if (!_checkpoint.is_open())
+        throw std::runtime_error("could not open checkpoint file " + filename);
+}
+
+void RandomForest::resume(const std::string &filename, int interval) {
+    std::ifstream in(filename.c_str());
+    std::string word;
+    int nClasses, nLabels;
+    in >> word >> _seed >> _nFeatures;
+    readClasses(in, nClasses, nLabels);
+    if (in.fail() || word.compare("checkpoint") != 0)
+        throw std::runtime_error("not a checkpoint file " + filename);
+    if (nClasses != _nClasses || nLabels != _nLabels)
+        throw std::runtime_error("number of classes in the checkpoint does not match the target");
+
+    while (in >> word && word.compare("block") == 0) {
+        int n;
+        in >> n;
+        std::vector<Tree *> trees;
+        std::vector<int> seeds;
+        for (int i = 0; i < n && !in.fail(); i++) {
+            int seed;
+            in >> seed;
+            trees.push_back(getTree());
+            seeds.push_back(seed);
+            trees.back()->load(in, _data);
+        }
+        in >> word;
+        if (in.fail() || word.compare("end") != 0) {
+            for (size_t i = 0; i < trees.size(); i++)
+                delete trees[i];
+            break;
+        }
+        _forest.insert(_forest.end(), trees.begin(), trees.end());
+        _seeds.insert(_seeds.end(), seeds.begin(), seeds.end());
+    }
+    in.close();
+    std::cout << "Resuming from " << _forest.size() << " trees in checkpoint " << filename << std::endl;
+
+    // rewrite the checkpoint, dropping anything that was partially written
+    checkpoint(filename, interval);
+}
+
+void RandomForest::grow(int nTrees) {
+    if (nTrees < (int) _forest.size())
+        throw std::runtime_error("the forest already has more trees than requested");
+    if (_nClasses != dataClasses() || _nLabels != _data->nLabels())
+        throw std::runtime_error("number of classes in the forest does not match the target");
+
+    std::cout << "Growing forest from " << _forest.size() << " to " << nTrees << " trees" << std::endl;
+    _nTrees = nTrees;
+    train();
+}
+
+void RandomForest::writeClasses(std::ostream &out) {
+    out << _nClasses;
+    if (_nLabels > 1)
+        out << " " << _nLabels;
+}
+
+void RandomForest::readClasses(std::istream &in, int &nClasses, int &nLabels) {
+    std::string line;
+    std::getline(in, line);
+    std::istringstream fields(line);
+    fields >> nClasses;
+    if (fields.fail())
+        in.setstate(std::ios::failbit);
+    if (!(fields >> nLabels))
+        nLabels = 1;
 }
 
 void RandomForest::save(std::ofstream &out) {
-    out << _forest.size() << " " << _nFeatures << " " << _nClasses << std::endl;
+    out << _forest.size() << " " << _nFeatures << " ";
+    writeClasses(out);
+    out << std::endl;
+    for (size_t i = 0; i < _forest.size(); i++)
+        _forest[i]->save(out, _data);
+}
+
+// a compacted forest starts with "compact <trees> <features> <classes> <nodes>", followed by
+// the node table and a line with the root of each tree
+void RandomForest::saveCompact(std::ofstream &out) {
+    Tree::CompactTable table(_data);
+    std::vector<int> roots;
+    for (size_t i = 0; i < _forest.size(); i++)
+        roots.push_back(_forest[i]->compact(table));
+
+    // the layout loadCompact() evaluates from, against one node per node of the trees
+    table.flatten(roots);
+    int nDouble = std::count(table._isDouble.begin(), table._isDouble.end(), true);
+    std::cout << "Compacted " << table._nCompacted << " nodes into " << table._nodes.size() <<
+            ", " << nDouble << " thresholds need double precision" << std::endl;
+    std::cout << "Evaluation layout of " << table._flat.size() << " nodes instead of " << table._nCompacted <<
+            ", the trees take " << table.bytes() << " bytes instead of " << table.compactedBytes() << std::endl;
+
+    Tree *tree = getTree();
+    out << "compact " << _forest.size() << " " << _nFeatures << " " << _nClasses << " " << table._nodes.size() << std::endl;
+    tree->saveCompact(table, out);
+    for (size_t i = 0; i < roots.size(); i++)
+        out << (i > 0 ? " " : "") << roots[i];
+    out << std::endl;
+    delete tree;
+}
+
+void RandomForest::loadCompact(std::ifstream &in) {
+    int nNodes;
+    in >> _nTrees >> _nFeatures >> _nClasses >> nNodes;
+    _nLabels = 1;
+    _table = new Tree::CompactTable(_data);
+    Tree::CompactTable &table = *_table;
+    Tree *tree = getTree();
+    tree->loadCompact(table, nNodes, in, _data);
+    delete tree;
+
+    std::vector<int> roots(_nTrees);
+    for (size_t i = 0; i < roots.size(); i++) {
+        in >> roots[i];
+        if (in.fail() || roots[i] < 0 || roots[i] >= nNodes)
+            throw std::runtime_error("malformed compacted forest");
+    }
+
+    // the trees are evaluated from the layout of the table, so that shared subtrees stay shared
+    table.flatten(roots);
+    _forest.resize(_nTrees);
+    for (size_t i = 0; i < _forest.size(); i++) {
+        _forest[i] = getTree();
+        _forest[i]->setRoot(table, i, roots[i]);
+    }
+}
+
+void RandomForest::clear() {
     for (size_t i = 0; i < _forest.size(); i++)
-        _forest[i]->save(out);
+        delete _forest[i];
+    _forest.clear();
+    _seeds.clear();
+    delete _table;
+    _table = NULL;
 }
 
 void RandomForest::load(std::ifstream &in) {
-    in >> _nTrees >> _nFeatures >> _nClasses;
+    clear();
+    if (in.peek() == 'c') {
+        std::string word;
+        in >> word;
+        if (word.compare("compact") == 0) {
+            loadCompact(in);
+            return;
+        }
+        throw std::runtime_error("unrecognized forest file");
+    }
+
+    in >> _nTrees >> _nFeatures;
+    readClasses(in, _nClasses, _nLabels);
     _forest.resize(_nTrees);
     for (size_t i = 0; i < _forest.size(); i++) {
         _forest[i] = getTree();
-        _forest[i]->load(in);
+        _forest[i]->load(in, _data);
+        _forest[i]->flatten();
+    }
+}
+
+void RandomForest::merge(const std::vector<std::string> &filenames, std::ofstream &out) {
+    int nTrees = 0, nFeatures = 0, nClasses = 0, nLabels = 0;
+    for (size_t i = 0; i < filenames.size(); i++) {
+        std::ifstream in(filenames[i].c_str());
+        int n, f, c, l;
+        in >> n >> f;
+        readClasses(in, c, l);
+        if (in.fail())
+            throw std::runtime_error("could not read forest " + filenames[i]);
+        if (i > 0 && (f != nFeatures || c != nClasses || l != nLabels))
+            throw std::runtime_error("forest " + filenames[i] + " does not match the other forests");
+        nTrees += n;
+        nFeatures = f;
+        nClasses = c;
+        nLabels = l;
+    }
+
+    out << nTrees << " " << nFeatures << " " << nClasses;
+    if (nLabels > 1)
+        out << " " << nLabels;
+    out << std::endl;
+    for (size_t i = 0; i < filenames.size(); i++) {
+        std::ifstream in(filenames[i].c_str());
+        std::string header;
+        std::getline(in, header);
+        if (in.peek() != std::ifstream::traits_type::eof())
+            out << in.rdbuf();
     }
 }
@@ -16,37 +16,56 @@
 
 
 #include "RegressionForest.h"
+#include "DenseData.h"
+#include "SparseData.h"
 #include <boost/thread.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/random.hpp>
+#include <algorithm>
 #include <ctime>
 
-double RegressionForest::evaluate(int uid) {
-    double retVal = 0;
-    for (size_t i = 0; i < _forest.size(); i++) {
-        double v;
-        ((RegressionTree *) _forest[i])->evaluate(*_data, uid, &v);
-        retVal += v;
-    }
+template <class D>
+void RegressionForest::evaluate(D &data, int start, int end, std::vector<double> &out) {
+    int nTargets = this->nTargets();
+    for (int uid = start; uid < end; uid++)
+        evaluate(data, uid, &out[uid * nTargets]);
+}
+
+template <class D>
+void RegressionForest::evaluate(D &data, int uid, double *out) {
+    int nTargets = this->nTargets();
+    std::fill(out, out + nTargets, 0);
+    for (size_t i = 0; i < _forest.size(); i++)
+        ((RegressionTree *) _forest[i])->evaluate(data, uid, out);
 
-    return retVal/_forest.size();
+    for (int t = 0; t < nTargets; t++)
+        out[t] /= _forest.size();
 }
 
-double RegressionForest::evaluate(int uid, std::vector<int> &permutation, int feature) {
-    double retVal = 0;
+template <class D>
+void RegressionForest::evaluate(D &data, int start, int end, std::vector<double> &out, std::vector<int> &permutation, int feature) {
+    int nTargets = this->nTargets();
+    for (int uid = start; uid < end; uid++)
+        evaluate(data, uid, permutation, feature, &out[uid * nTargets]);
+}
+
+template <class D>
+void RegressionForest::evaluate(D &data, int uid, std::vector<int> &permutation, int feature, double *out) {
+    int nTargets = this->nTargets();
+    std::fill(out, out + nTargets, 0);
     int cnt = 0;
     for (size_t i = 0; i < _forest.size(); i++) {
-        double v;
-        if (((RegressionTree *) _forest[i])->evaluateOOB(*_data, uid, permutation, feature, &v)) {
-            retVal += v;
+        if (((RegressionTree *) _forest[i])->evaluateOOB(data, uid, permutation, feature, out))
             cnt++;
-        }
     }
 
-    return retVal /cnt;
+    for (int t = 0; t < nTargets; t++)
+        out[t] /= cnt;
  }
 
 void RegressionForest::evaluateThread(std::vector<double> *vals) {
+    DenseData *dense = dynamic_cast<DenseData *>(_data);
+    SparseData *sparse = dynamic_cast<SparseData *>(_data);
     bool done = false;
     while (!done) {
         int start, end;
@@ -60,12 +79,18 @@ void RegressionForest::evaluateThread(std::vector<double> *vals) {
             }
             _counter = end;
         }
-        for (int uid = start; uid < end; uid++)
-	    vals->at(uid) = evaluate(uid);
+        if (dense)
+            evaluate(*dense, start, end, *vals);
+        else if (sparse)
+            evaluate(*sparse, start, end, *vals);
+        else
+            evaluate(*_data, start, end, *vals);
     }
 }
 
 void RegressionForest::evaluateOOBThread(std::vector<double> *out, std::vector<int> *permutation, int feature) {
+    DenseData *dense = dynamic_cast<DenseData *>(_data);
+    SparseData *sparse = dynamic_cast<SparseData *>(_data);
     bool done = false;
     while (!done) {
         int start, end;
@@ -79,8 +104,12 @@ void RegressionForest::evaluateOOBThread(std::vector<double> *out, std::vector<i
             }
             _counter = end;
         }
-        for (int uid = start; uid < end; uid++)
-	    out->at(uid) = evaluate(uid, *permutation, feature);
+        if (dense)
+            evaluate(*dense, start, end, *out, *permutation, feature);
+        else if (sparse)
+            evaluate(*sparse, start, end, *out, *permutation, feature);
+        else
+            evaluate(*_data, start, end, *out, *permutation, feature);
     }    
 }
 
@@ -17,16 +17,116 @@
 
 #include "RegressionTree.h"
 #include "DataSubset.h"
+#include "RadixSort.h"
 #include <algorithm>
 #include <iostream>
+#include <iomanip>
 #include <cassert>
+#include <cmath>
+#include <stdexcept>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// finds the split of sorted values into the first i values and the rest (1 <= i < n) with the
+// smallest squared error, considering only value boundaries x[i-1] < x[i]. sum and sum2 hold
+// n+1 prefix sums of y and y^2. returns 0 if all the values are equal. ties go to the
+// smallest i, like a serial walk over the values would.
+static size_t bestSplitPosition(const double *x, const double *sum, const double *sum2, size_t n, double &bestSE) {
+    const double total = sum[n], total2 = sum2[n];
+    size_t best = 0;
+    bestSE = HUGE_VAL;
+    size_t i = 1;
+
+#if defined(__AVX__)
+    const __m256d vN = _mm256_set1_pd(n), vTotal = _mm256_set1_pd(total), vTotal2 = _mm256_set1_pd(total2);
+    const __m256d step = _mm256_set1_pd(4);
+    __m256d pos = _mm256_set_pd(4, 3, 2, 1);
+    __m256d minSE = _mm256_set1_pd(HUGE_VAL), minPos = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        __m256d less = _mm256_loadu_pd(sum + i), less2 = _mm256_loadu_pd(sum2 + i);
+        __m256d more = _mm256_sub_pd(vTotal, less), more2 = _mm256_sub_pd(vTotal2, less2);
+        __m256d se = _mm256_add_pd(_mm256_sub_pd(less2, _mm256_div_pd(_mm256_mul_pd(less, less), pos)),
+                _mm256_sub_pd(more2, _mm256_div_pd(_mm256_mul_pd(more, more), _mm256_sub_pd(vN, pos))));
+        __m256d boundary = _mm256_cmp_pd(_mm256_loadu_pd(x + i - 1), _mm256_loadu_pd(x + i), _CMP_LT_OQ);
+        __m256d better = _mm256_and_pd(boundary, _mm256_cmp_pd(se, minSE, _CMP_LT_OQ));
+        minSE = _mm256_blendv_pd(minSE, se, better);
+        minPos = _mm256_blendv_pd(minPos, pos, better);
+        pos = _mm256_add_pd(pos, step);
+    }
+    const int lanes = 4;
+    double laneSE[lanes], lanePos[lanes];
+    _mm256_storeu_pd(laneSE, minSE);
+    _mm256_storeu_pd(lanePos, minPos);
+#elif defined(__SSE2__)
+    const __m128d vN = _mm_set1_pd(n), vTotal = _mm_set1_pd(total), vTotal2 = _mm_set1_pd(total2);
+    const __m128d step = _mm_set1_pd(2);
+    __m128d pos = _mm_set_pd(2, 1);
+    __m128d minSE = _mm_set1_pd(HUGE_VAL), minPos = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+        __m128d less = _mm_loadu_pd(sum + i), less2 = _mm_loadu_pd(sum2 + i);
+        __m128d more = _mm_sub_pd(vTotal, less), more2 = _mm_sub_pd(vTotal2, less2);
+        __m128d se = _mm_add_pd(_mm_sub_pd(less2, _mm_div_pd(_mm_mul_pd(less, less), pos)),
+                _mm_sub_pd(more2, _mm_div_pd(_mm_mul_pd(more, more), _mm_sub_pd(vN, pos))));
+        __m128d boundary = _mm_cmplt_pd(_mm_loadu_pd(x + i - 1), _mm_loadu_pd(x + i));
+        __m128d better = _mm_and_pd(boundary, _mm_cmplt_pd(se, minSE));
+        minSE = _mm_or_pd(_mm_and_pd(better, se), _mm_andnot_pd(better, minSE));
+        minPos = _mm_or_pd(_mm_and_pd(better, pos), _mm_andnot_pd(better, minPos));
+        pos = _mm_add_pd(pos, step);
+    }
+    const int lanes = 2;
+    double laneSE[lanes], lanePos[lanes];
+    _mm_storeu_pd(laneSE, minSE);
+    _mm_storeu_pd(lanePos, minPos);
+#else
+    const int lanes = 0;
+    double *laneSE = NULL, *lanePos = NULL;
+#endif
+
+    for (int l = 0; l < lanes; l++) {
+        size_t p = (size_t) lanePos[l];
+        if (p > 0 && (laneSE[l] < bestSE || (laneSE[l] == bestSE && p < best))) {
+            bestSE = laneSE[l];
+            best = p;
+        }
+    }
+
+    // the positions that don't fill a vector all come after the ones that did
+    for (; i < n; i++) {
+        if (x[i - 1] < x[i]) {
+            double less = sum[i], more = total - sum[i];
+            double se = sum2[i] - less * less / i + (total2 - sum2[i]) - more * more / (n - i);
+            if (se < bestSE) {
+                bestSE = se;
+                best = i;
+            }
+        }
+    }
+    return best;
+}
+
+RegressionTree::RegressionTree(int nTargets) : Tree(), _nTargets(nTargets) {
+    _empty._val = 0;
+    clearValues();
+}
 
-RegressionTree::RegressionTree() : Tree() {
+void RegressionTree::clearValues() {
+    if (_nTargets > 1) {
+        _outputs.assign(_nTargets, 0);
+        _empty._cls = 0;
+    }
 }
 
 bool RegressionTree::checkAndMakeLeaf(DataSubset &data, const std::vector<int> &userIndeces, Node *node, int depth, bool forceLeaf) {
     node->_isLeaf = false;
-    if (userIndeces.size() == 0) {
+    if (_nTargets > 1) {
+        if (userIndeces.size() == 0 || forceLeaf || (_maxDepth > 0 && depth >= _maxDepth) || userIndeces.size() < _minSplit) {
+            node->_isLeaf = true;
+            node->_cls = averageValues(data, userIndeces);
+        }
+    } else if (userIndeces.size() == 0) {
         node->_isLeaf = true;
         node->_val = 0;
     } else if (isSingleValue(data, userIndeces)) {
@@ -56,39 +156,31 @@ double RegressionTree::averageValue(DataSubset &data, const std::vector<int> &us
     return val/users.size();
 }
 
-void RegressionTree::bestThreshold(DataSubset &data, int feature, double &bestSE, double &bestSplit) {
-    DataSubsetIterator users(data, feature);
+// appends the average of every target to _outputs, and returns the index of the leaf
+int RegressionTree::averageValues(DataSubset &data, const std::vector<int> &users) {
+    int leaf = _outputs.size() / _nTargets;
+    for (int t = 0; t < _nTargets; t++) {
+        double val = 0;
+        for (size_t i = 0; i < users.size(); i++)
+            val += data.regressionY(users[i], t);
+        _outputs.push_back(users.empty() ? 0 : val / users.size());
+    }
+    return leaf;
+}
 
-    double noValueSum = 0, noValueSum2 = 0;
-    double moreThanSum = 0, moreThanSum2 = 0;
-    double lessThanSum = 0, lessThanSum2 = 0;
-    int noValueCnt = 0, moreThanCnt = 0, lessThanCnt = 0;
-    
-    std::vector<std::pair<double, double> > values;
-    values.reserve(users.size());
+void RegressionTree::bestThreshold(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &bestSE, double &bestSplit) {
+    if (_nTargets > 1) {
+        bestThresholdTargets(data, noValue, values, users, bestSE, bestSplit);
+        return;
+    }
 
     // initialize the counts and sums
-    const std::vector<int> &userIndeces = data.getUsers();
-    size_t u = 0;
-    while (u < userIndeces.size()) {
-        assert(!users.hasNext() || users.index() >= userIndeces[u]);
-        while (u < userIndeces.size() && (!users.hasNext() || users.index() > userIndeces[u])) {
-            double y = data.regressionY(userIndeces[u]);
-            noValueCnt++;
-            noValueSum += y;
-            noValueSum2 += y * y;
-            u++;
-        }
-        // everything with a value goes to moreThan at this point
-        while (users.hasNext() && u < userIndeces.size() && users.index() == userIndeces[u]) {
-            double y = data.regressionY(users.index());
-            values.push_back(std::pair<double, double>(users.value(), y));
-            moreThanCnt++;
-            moreThanSum += y;
-            moreThanSum2 += y * y;
-            users.next();
-            u++;
-        }
+    double noValueSum = 0, noValueSum2 = 0;
+    int noValueCnt = noValue.size();
+    for (size_t i = 0; i < noValue.size(); i++) {
+        double y = data.regressionY(noValue[i]);
+        noValueSum += y;
+        noValueSum2 += y * y;
     }
 
     // compute the sum of squared errors
@@ -102,60 +194,123 @@ void RegressionTree::bestThreshold(DataSubset &data, int feature, double &bestSE
         return;
     }
     
+    // sort the values, and take prefix sums of y and y^2 in that order
+    std::vector<unsigned int> order;
+    radixSort(values, order);
+    size_t n = values.size();
+    const double *x = &values[0];
+    std::vector<double> sum(n + 1), sum2(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        double y = data.regressionY(users[order[i]]);
+        sum[i + 1] = sum[i] + y;
+        sum2[i + 1] = sum2[i] + y * y;
+    }
+
     // we are starting with "everything is bigger than alpha"
-    // sort the values
-    std::sort(values.begin(), values.end());
-    double split = values[0].first - 1;
-    double maxVal = values[values.size() - 1].first;
-    size_t index = 0;
+    bestSE = sum2[n] - sum[n] * sum[n] / n;
+    bestSplit = x[0] - 1;
+    
+    assert(bestSE >= -1e-6);
 
-    double moreThanSE = moreThanSum2 - moreThanSum * moreThanSum / moreThanCnt;
-    double lessThanSE = 0;
-    double SE = moreThanSE;
+    double SE;
+    size_t split = bestSplitPosition(x, &sum[0], &sum2[0], n, SE);
+    if (split > 0 && SE < bestSE) {
+        bestSE = SE;
+        bestSplit = (x[split - 1] + x[split]) / 2;
+    }
 
-    bestSE = SE;
-    bestSplit = split;
-    
-    assert(SE >= -1e-6);
+    bestSE = -bestSE - noValueSE;
+}
 
-    // walk the sorted values, and compute the squared error. keep track of the minimum
-    while (split < maxVal) {
-        // find the next split value
-        split = values[index].first;
-        while (index < values.size() && values[index].first <= split) {
-            double y = values[index].second;            
-            moreThanSum -= y;
-            moreThanSum2 -= y * y;
-            moreThanCnt--;
-
-            lessThanSum += y;
-            lessThanSum2 += y * y;
-            lessThanCnt++;
-            index++;
+// the split search with several targets: the squared errors of all the targets are added up,
+// at every position of the one sort of the values
+void RegressionTree::bestThresholdTargets(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &bestSE, double &bestSplit) {
+    double noValueSE = 0;
+    for (int t = 0; t < _nTargets && !noValue.empty(); t++) {
+        double noValueSum = 0, noValueSum2 = 0;
+        for (size_t i = 0; i < noValue.size(); i++) {
+            double y = data.regressionY(noValue[i], t);
+            noValueSum += y;
+            noValueSum2 += y * y;
         }
-        if (index < values.size()) {
-            split = index >= values.size() ? values[index - 1].first + 1 : (values[index - 1].first + values[index].first) / 2;
+        noValueSE += noValueSum2 - noValueSum * noValueSum / noValue.size();
+    }
 
-            moreThanSE = moreThanSum2 - moreThanSum * moreThanSum / moreThanCnt;
-            lessThanSE = lessThanSum2 - lessThanSum * lessThanSum / lessThanCnt;
-            SE = moreThanSE + lessThanSE;
-            
-            assert(moreThanSE >= -1e-6 && lessThanSE >= -1e-6);
+    if (values.size() == 0) {
+        bestSE = noValueSE;
+        bestSplit = 0;
+        return;
+    }
 
-            if (SE < bestSE) {
-                bestSE = SE;
-                bestSplit = split;
-            }
+    std::vector<unsigned int> order;
+    radixSort(values, order);
+    size_t n = values.size();
+    const double *x = &values[0];
+
+    // SE[i] is the error of splitting into the first i values and the rest
+    std::vector<double> SE(n, 0), sum(n + 1), sum2(n + 1);
+    double allSE = 0;
+    for (int t = 0; t < _nTargets; t++) {
+        for (size_t i = 0; i < n; i++) {
+            double y = data.regressionY(users[order[i]], t);
+            sum[i + 1] = sum[i] + y;
+            sum2[i + 1] = sum2[i] + y * y;
+        }
+        allSE += sum2[n] - sum[n] * sum[n] / n;
+        for (size_t i = 1; i < n; i++) {
+            double less = sum[i], more = sum[n] - sum[i];
+            SE[i] += sum2[i] - less * less / i + (sum2[n] - sum2[i]) - more * more / (n - i);
+        }
+    }
+
+    // we are starting with "everything is bigger than alpha"
+    bestSE = allSE;
+    bestSplit = x[0] - 1;
+    for (size_t i = 1; i < n; i++) {
+        if (x[i - 1] < x[i] && SE[i] < bestSE) {
+            bestSE = SE[i];
+            bestSplit = (x[i - 1] + x[i]) / 2;
         }
     }
 
     bestSE = -bestSE - noValueSE;
 }
 
+double RegressionTree::scoreThreshold(DataSubset &data, const std::vector<int> &noValue, const std::vector<double> &values, const std::vector<int> &users, double threshold) {
+    double noValueSE = 0, SE = 0;
+    for (int t = 0; t < _nTargets; t++) {
+        double noValueSum = 0, noValueSum2 = 0;
+        for (size_t i = 0; i < noValue.size(); i++) {
+            double y = data.regressionY(noValue[i], t);
+            noValueSum += y;
+            noValueSum2 += y * y;
+        }
+
+        double sum[2] = {0, 0}, sum2[2] = {0, 0};
+        int cnt[2] = {0, 0};
+        for (size_t i = 0; i < values.size(); i++) {
+            double y = data.regressionY(users[i], t);
+            int side = values[i] < threshold ? 0 : 1;
+            sum[side] += y;
+            sum2[side] += y * y;
+            cnt[side]++;
+        }
+
+        if (!noValue.empty())
+            noValueSE += noValueSum2 - noValueSum * noValueSum / noValue.size();
+        for (int side = 0; side < 2; side++)
+            if (cnt[side] > 0)
+                SE += sum2[side] - sum[side] * sum[side] / cnt[side];
+    }
+
+    // the same sign convention as bestThreshold
+    return -SE - noValueSE;
+}
+
 void RegressionTree::evaluate(Data &data, int uid, double *out) {
     Node *node = getNode(data, uid);
 
-    *out = node->_val;
+    addValues(node, out);
 }
 
 
@@ -164,7 +319,7 @@ bool RegressionTree::evaluateOOB (Data &data, int uid, std::vector<int> &permuta
     if (!node) 
         return false;
     
-    *out = node->_val;
+    addValues(node, out);
     return true;
 }
 
@@ -173,28 +328,69 @@ void RegressionTree::load(Node *node, std::ifstream &in) {
     node->_greaterThan = NULL;
     node->_lessThan = NULL;
 
-    in >> node->_isLeaf >>
-            node->_val >>
-            node->_threshold >>
+    // with several targets, a leaf has a value for each of them
+    int kind;
+    in >> kind;
+    if (kind == LEAF && _nTargets > 1) {
+        node->_cls = _outputs.size() / _nTargets;
+        for (int t = 0; t < _nTargets; t++) {
+            double v;
+            in >> v;
+            _outputs.push_back(v);
+        }
+    } else {
+        in >> node->_val;
+    }
+    in >> node->_threshold >>
             node->_feature; 
+    // stop at a truncated file, rather than reading children forever
+    if (in.fail())
+        kind = LEAF;
+    node->_isLeaf = kind == LEAF;
+    if (!node->_isLeaf)
+        node->_feature = loadedFeature(node->_feature);
     
     if (!node->_isLeaf) {
-        node->_noValue = new Node;
-        load(node->_noValue, in);        
-        node->_greaterThan = new Node;
+        if (kind != BINARY) {
+            node->_noValue = _nodes.allocate();
+            load(node->_noValue, in);        
+        }
+        node->_greaterThan = _nodes.allocate();
         load(node->_greaterThan, in);        
-        node->_lessThan = new Node;
+        node->_lessThan = _nodes.allocate();
         load(node->_lessThan, in);        
     }
 }
 
+void RegressionTree::saveValue(Node *node, std::ostream &out) {
+    if (_nTargets > 1)
+        throw std::runtime_error("compacted forests support a single regression target");
+    out << std::setprecision(floatDigits(node->_val)) << node->_val << std::setprecision(6);
+}
+
+void RegressionTree::loadValue(Node *node, std::istream &in) {
+    in >> node->_val;
+}
+
 void RegressionTree::save(Node *node, std::ofstream &out) {
     assert(!node->_isLeaf || (node->_noValue == NULL && node->_greaterThan == NULL && node->_lessThan == NULL));
-    assert(node->_isLeaf || (node->_noValue != NULL && node->_greaterThan != NULL && node->_lessThan != NULL));
+    assert(node->_isLeaf || (node->_greaterThan != NULL && node->_lessThan != NULL));
     
-    out << node->_isLeaf << " " << node->_val << " " << node->_threshold << " " << node->_feature << std::endl;    
+    int kind = node->_isLeaf ? LEAF : node->_noValue ? INTERNAL : BINARY;
+    out << kind << " ";
+    if (node->_isLeaf && _nTargets > 1) {
+        // the outputs are doubles, written with all their digits so that they load unchanged
+        out << std::setprecision(17);
+        for (int t = 0; t < _nTargets; t++)
+            out << _outputs[node->_cls * _nTargets + t] << " ";
+        out << std::setprecision(6);
+    } else {
+        out << node->_val << " ";
+    }
+    out << node->_threshold << " " << savedFeature(node) << std::endl;    
     if (!node->_isLeaf) {
-        save(node->_noValue, out);
+        if (node->_noValue)
+            save(node->_noValue, out);
         save(node->_greaterThan, out);
         save(node->_lessThan, out);
     }
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2014 Ofer Shai
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "ScoringServer.h"
+#include "ClassificationForest.h"
+#include "RegressionForest.h"
+#include "SparseData.h"
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// number of request latencies kept for the percentiles
+#define LATENCY_WINDOW 100000
+
+ScoringServer::ScoringServer(RandomForest *forest, bool classification, int batchSize, int batchWait) :
+        _forest(forest), _classification(classification), _batchSize(batchSize), _batchWait(batchWait),
+        _nextLatency(0), _nRequests(0), _nBatches(0) {
+    _startTime = now();
+}
+
+double ScoringServer::now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+bool ScoringServer::parseRequest(const std::string &line, Request &request, std::string &error) {
+    std::istringstream in(line);
+    std::string kind;
+    in >> kind;
+
+    if (kind.compare("dense") == 0) {
+        double v;
+        int f = 0;
+        while (in >> v)
+            request._row.push_back(std::pair<int, double>(f++, v));
+    } else if (kind.compare("sparse") == 0) {
+        std::string token;
+        while (in >> token) {
+            int f;
+            double v;
+            if (sscanf(token.c_str(), "%d:%lf", &f, &v) != 2 || f < 0) {
+                error = "malformed feature " + token;
+                return false;
+            }
+            request._row.push_back(std::pair<int, double>(f, v));
+        }
+        std::sort(request._row.begin(), request._row.end());
+    } else {
+        error = "unknown request " + kind;
+        return false;
+    }
+
+    if (!in.eof()) {
+        error = "malformed " + kind + " row";
+        return false;
+    }
+    return true;
+}
+
+void ScoringServer::evaluateBatch(std::vector<Request *> &batch) {
+    std::vector<std::vector<std::pair<int, double> > > rows(batch.size());
+    for (size_t i = 0; i < batch.size(); i++)
+        rows[i].swap(batch[i]->_row);
+
+    SparseData data;
+    data.loadRows(rows);
+    _forest->setData(&data);
+
+    if (_classification) {
+        std::vector<std::vector<double> > prob(batch.size());
+        ((ClassificationForest *) _forest)->evaluate(prob);
+        for (size_t i = 0; i < batch.size(); i++)
+            batch[i]->_result.swap(prob[i]);
+    } else {
+        int nTargets = ((RegressionForest *) _forest)->nTargets();
+        std::vector<double> Y(batch.size() * nTargets);
+        ((RegressionForest *) _forest)->evaluate(Y);
+        for (size_t i = 0; i < batch.size(); i++)
+            batch[i]->_result.assign(Y.begin() + i * nTargets, Y.begin() + (i + 1) * nTargets);
+    }
+    _forest->setData(NULL);
+}
+
+void ScoringServer::batchThread() {
+    std::vector<Request *> batch;
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(_mtx);
+            while (_queue.empty())
+                _queued.wait(lock);
+
+            // give concurrent connections a chance to add their rows to the batch
+            boost::system_time deadline = boost::get_system_time() + boost::posix_time::microseconds(_batchWait);
+            while (_queue.size() < (size_t) _batchSize)
+                if (!_queued.timed_wait(lock, deadline))
+                    break;
+
+            batch.clear();
+            while (!_queue.empty() && batch.size() < (size_t) _batchSize) {
+                batch.push_back(_queue.front());
+                _queue.pop_front();
+            }
+        }
+
+        evaluateBatch(batch);
+
+        {
+            boost::unique_lock<boost::mutex> lock(_mtx);
+            double end = now();
+            for (size_t i = 0; i < batch.size(); i++) {
+                if (_latencies.size() < LATENCY_WINDOW)
+                    _latencies.push_back(end - batch[i]->_start);
+                else
+                    _latencies[_nextLatency] = end - batch[i]->_start;
+                _nextLatency = (_nextLatency + 1) % LATENCY_WINDOW;
+                batch[i]->_done = true;
+            }
+            _nRequests += batch.size();
+            _nBatches++;
+        }
+        _evaluated.notify_all();
+    }
+}
+
+std::string ScoringServer::stats() {
+    boost::unique_lock<boost::mutex> lock(_mtx);
+    std::vector<double> latencies(_latencies);
+    double elapsed = now() - _startTime;
+
+    std::ostringstream out;
+    out << "requests " << _nRequests << " batches " << _nBatches
+            << " throughput " << (elapsed > 0 ? _nRequests / elapsed : 0);
+    if (latencies.empty()) {
+        out << " p50 0 p99 0";
+    } else {
+        // percentiles are in milliseconds
+        size_t p50 = latencies.size() / 2;
+        size_t p99 = latencies.size() * 99 / 100;
+        std::nth_element(latencies.begin(), latencies.begin() + p50, latencies.end());
+        out << " p50 " << latencies[p50] * 1000;
+        std::nth_element(latencies.begin(), latencies.begin() + p99, latencies.end());
+        out << " p99 " << latencies[p99] * 1000;
+    }
+    return out.str();
+}
+
+void ScoringServer::connectionThread(int fd) {
+    std::string buffer;
+    char chunk[65536];
+
+    while (true) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0)
+            break;
+        buffer.append(chunk, n);
+
+        size_t eol;
+        while ((eol = buffer.find('\n')) != std::string::npos) {
+            std::string line = buffer.substr(0, eol);
+            buffer.erase(0, eol + 1);
+            if (!line.empty() && line[line.size() - 1] == '\r')
+                line.resize(line.size() - 1);
+            if (line.empty())
+                continue;
+
+            std::string response;
+            Request request;
+            std::string error;
+            if (line.compare("stats") == 0) {
+                response = stats();
+            } else if (!parseRequest(line, request, error)) {
+                response = "error " + error;
+            } else {
+                request._start = now();
+                boost::unique_lock<boost::mutex> lock(_mtx);
+                _queue.push_back(&request);
+                _queued.notify_one();
+                while (!request._done)
+                    _evaluated.wait(lock);
+
+                std::ostringstream out;
+                for (size_t i = 0; i < request._result.size(); i++)
+                    out << (i > 0 ? " " : "") << request._result[i];
+                response = out.str();
+            }
+            response += '\n';
+
+            size_t sent = 0;
+            while (sent < response.size()) {
+                ssize_t s = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (s <= 0) {
+                    close(fd);
+                    return;
+                }
+                sent += s;
+            }
+        }
+    }
+    close(fd);
+}
+
+void ScoringServer::run(const std::string &path) {
+    struct sockaddr_un addr;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("socket path is too long: " + path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        throw std::runtime_error("could not create socket");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+        throw std::runtime_error("could not bind socket " + path + ": " + strerror(errno));
+    if (listen(listener, 128) != 0)
+        throw std::runtime_error("could not listen on socket " + path + ": " + strerror(errno));
+
+    std::cout << "Serving on " << path << std::endl;
+    boost::thread batcher(boost::bind(&ScoringServer::batchThread, this));
+
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("accept failed: ") + strerror(errno));
+        }
+        boost::thread connection(boost::bind(&ScoringServer::connectionThread, this, fd));
+        connection.detach();
+    }
+}
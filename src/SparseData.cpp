@@ -23,6 +23,25 @@
 #include <stdexcept>
 #include <set>
 #include <algorithm>
+#include <cstring>
+#include <boost/cstdint.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// below this many values per thread, the transpose isn't worth starting threads for
+#define MIN_TRANSPOSE_SHARE (1 << 16)
+
+// number of rows in a block of a compressed column
+#define COLUMN_BLOCK 128
+
+// above this ratio between the lengths of the user list and the column, iterator() gallops
+// over the longer one instead of merging
+#define GALLOP_RATIO 4
 
 void SparseData::loadFeatures(std::string filename) {
     FILE *file = fopen(filename.c_str(), "r");
@@ -54,9 +73,10 @@ void SparseData::loadFeatures(std::string filename) {
     if (!mm_is_coordinate(typecode) || !mm_is_real(typecode) || !mm_is_general(typecode))
         throw std::runtime_error ("Unsupported Matrix Market file. Currently, only cooridnate real general files are supported for sparse features");
 
-    int M, N, nz;
+    int M, N;
+    long nz;
       
-    rc = mm_read_mtx_crd_size(file, &M, &N, &nz);
+    rc = mm_read_mtx_crd_size_long(file, &M, &N, &nz);
     if (rc != 0) {
         std::string err;
         switch (rc) {
@@ -64,29 +84,29 @@ void SparseData::loadFeatures(std::string filename) {
                 err = "Premature EOF at size info";
                 break;
             default:
-                err = "Unexpected return value from mm_read_mtx_crd_size";
+                err = "Unexpected return value from mm_read_mtx_crd_size_long";
         }
         throw std::runtime_error (err);
     }
 
     _nUsers = M; // users must start at 1
-    _nFeatures = N + 1; // to account for users either starting at 1 or 0x
-    _featureList.resize(N);
-    for (int i = 0; i < N; i++) {
-        _featureList[i] = i;
-    }
+    std::vector<int> columns;
+    projectColumns(N + 1, columns); // to account for users either starting at 1 or 0x
 
     std::cout << "users:" << _nUsers << std::endl;
     std::cout << "features:" << _nFeatures << std::endl;
     std::cout << "nnz:" << nz << std::endl;
-    _featureList.resize(_nFeatures);
-    for (int idx = 0; idx < _nFeatures; ++idx) {
-        _featureList[idx]=idx;
-    }
     
     _user.resize(_nUsers); 
-    _feature.resize(nz);
-    _val.resize(nz);
+    // with a projection, the number of values that are kept is only known at the end
+    _feature.clear();
+    _val.clear();
+    if (!_projected) {
+        _feature.reserve(nz);
+        _val.reserve(nz);
+    }
+    // the features are counted while parsing, rather than in another pass for the transpose
+    std::vector<int> counts(_nFeatures);
 
     int prevX = 0;
     int prevY = -1;
@@ -94,12 +114,14 @@ void SparseData::loadFeatures(std::string filename) {
     int x, y;
     double v;
 
-    for (int idx = 0; idx < nz; idx++) {
+    for (long idx = 0; idx < nz; idx++) {
         rc = fscanf(file, "%d %d %lf", &x, &y, &v);
         x--; // users are indexed at 1 in the matrix market file
 
         if (rc < 3)
             throw std::runtime_error ("Unexpected error while reading the input file");
+        if (x < 0 || x >= (int) _nUsers)
+            throw std::runtime_error ("Row out of range");
 
         if (x < prevX) {
             std::cerr << "Rows must be monotonically non-decreasing. found " << x << " after " << prevX << std::endl;
@@ -107,94 +129,423 @@ void SparseData::loadFeatures(std::string filename) {
         } else if (x > prevX) {
             prevY = -1;
             for (; prevX < x; prevX++)
-                _user[prevX] = idx;
+                _user[prevX] = _feature.size();
         }
         if (y <= prevY) {
 	        std::cerr << "Columns must be monotonically non-decreasing within a row. found " << y << " after " << prevY << " for user (row) " << x << std::endl;
 	        throw std::runtime_error ("Columns must be monotonically non-decreasing within a row");
 	    }
 
+        if (y < 0 || y >= (int) columns.size())
+            throw std::runtime_error ("Column out of range");
+
         prevY = y;
-        _feature[idx] = y;
-        _val[idx] = v;
+        if (columns[y] < 0)
+            continue;
+        counts[columns[y]]++;
+        _feature.push_back(columns[y]);
+        _val.push_back(v);
 
     }
-    _user[x] = nz;
+    // the rows after the last value are empty
+    for (; prevX < (int) _nUsers; prevX++)
+        _user[prevX] = _feature.size();
+    if (_projected) {
+        std::cout << "nnz of the filtered features:" << _feature.size() << std::endl;
+        std::vector<int>(_feature).swap(_feature);
+        std::vector<double>(_val).swap(_val);
+    }
   
-    transpose();
+    if (_columns) {
+        transpose(counts);
+        if (_compressed)
+            compress();
+    }
+}
+
+void SparseData::loadRows(const std::vector<std::vector<std::pair<int, double> > > &rows) {
+    _nUsers = rows.size();
+    _nFeatures = 0;
+    _user.resize(_nUsers);
+    _feature.clear();
+    _val.clear();
+
+    for (size_t u = 0; u < rows.size(); u++) {
+        for (size_t i = 0; i < rows[u].size(); i++) {
+            _feature.push_back(rows[u][i].first);
+            _val.push_back(rows[u][i].second);
+            if (rows[u][i].first >= (int) _nFeatures)
+                _nFeatures = rows[u][i].first + 1;
+        }
+        _user[u] = _feature.size();
+    }
+
+    _featureList.resize(_nFeatures);
+    for (int idx = 0; idx < _nFeatures; ++idx) {
+        _featureList[idx] = idx;
+    }
+    // rows loaded this way are only evaluated, so the column layout used by
+    // iterator() is not built
+    _columns = false;
+    _userT.clear();
+    _featureT.clear();
+    _valT.clear();
+    _packed.clear();
 }
 
 bool SparseData::at(int u, int f, double &v) {
-    int start = u == 0 ? 0 : _user[u-1];
-    int end = _user[u];
-    int idx = (end+start)/2;
-    while (end > start) {
-        idx = (start + end)/2;
-        if (_feature[idx] == f) {
-            v = _val[idx];
-            return true;
-        } else if (_feature[idx] < f) {
-            start = idx+1;
-        } else {
-            end = idx;
+    return get(u, f, v);
+}
+
+void SparseData::countRange(int start, int end, std::vector<int> *counts) {
+    counts->assign(_nFeatures, 0);
+    for (long j = start == 0 ? 0 : _user[start - 1]; j < _user[end - 1]; j++)
+        (*counts)[_feature[j]]++;
+}
+
+void SparseData::scatterRange(int start, int end, std::vector<long> *offsets) {
+    std::vector<long> &next = *offsets;
+    long j = start == 0 ? 0 : _user[start - 1];
+    for (int i = start; i < end; i++) {
+        for (; j < _user[i]; j++) {
+            long idx = next[_feature[j]]++;
+            _userT[idx] = i;
+            _valT[idx] = _val[j];
         }
     }
-    return false;    
 }
 
-void SparseData::transpose() {
+void SparseData::transpose(std::vector<int> &counts) {
     _userT.clear();
     _userT.resize(_val.size());
     _featureT.clear();
     _featureT.resize(_nFeatures);
     _valT.clear();
     _valT.resize(_val.size());
-
-    std::vector<int> counts(_nFeatures);
-    for (size_t j = 0; j < _feature.size(); j++) {
-        counts[_feature[j]]++;
-    }
+    if (_nFeatures == 0 || _nUsers == 0)
+        return;
 
     _featureT[0] = counts[0];
-    counts[0] = 0;
-    for (size_t j = 1; j < _nFeatures; j++) {
+    for (size_t j = 1; j < _nFeatures; j++)
         _featureT[j] = _featureT[j - 1] + counts[j];
-        counts[j] = 0;
+
+    // every thread takes a contiguous range of rows with about the same number of values
+    int nThreads = std::min((size_t) _nThreads, std::max((size_t) 1, _val.size() / MIN_TRANSPOSE_SHARE));
+    std::vector<int> bounds(nThreads + 1);
+    bounds[0] = 0;
+    for (int t = 1; t < nThreads; t++) {
+        long nz = (long) _val.size() / nThreads * t;
+        bounds[t] = std::max(bounds[t - 1], (int) (std::upper_bound(_user.begin(), _user.end(), nz) - _user.begin()));
     }
+    bounds[nThreads] = _nUsers;
 
-    int j = 0;
-    for (size_t i = 0; i < _nUsers; i++) {
-        for (; j < _user[i]; j++) {
-            int idx = (_feature[j] <= 0 ? 0 : _featureT[_feature[j] - 1]) + counts[_feature[j]];
-            _userT[idx] = i;
-            _valT[idx] = _val[j];
-            counts[_feature[j]]++;
+    // offsets[t][f] is where thread t writes its first value of feature f. the ranges follow
+    // each other in row order, so the rows in each column stay sorted
+    std::vector<std::vector<int> > threadCounts(nThreads);
+    if (nThreads > 1) {
+        boost::thread_group pool;
+        for (int t = 0; t < nThreads - 1; t++)
+            if (bounds[t] < bounds[t + 1])
+                pool.create_thread(boost::bind(&SparseData::countRange, this, bounds[t], bounds[t + 1], &threadCounts[t]));
+        pool.join_all();
+    }
+    std::vector<std::vector<long> > offsets(nThreads, std::vector<long>(_nFeatures));
+    for (size_t f = 0; f < _nFeatures; f++) {
+        long next = f == 0 ? 0 : _featureT[f - 1];
+        for (int t = 0; t < nThreads; t++) {
+            offsets[t][f] = next;
+            if (!threadCounts[t].empty())
+                next += threadCounts[t][f];
         }
     }
+
+    if (nThreads == 1) {
+        scatterRange(0, _nUsers, &offsets[0]);
+    } else {
+        boost::thread_group pool;
+        for (int t = 0; t < nThreads; t++)
+            if (bounds[t] < bounds[t + 1])
+                pool.create_thread(boost::bind(&SparseData::scatterRange, this, bounds[t], bounds[t + 1], &offsets[t]));
+        pool.join_all();
+    }
+}
+
+std::vector<int> SparseData::featureRanges() {
+    int nThreads = std::min((size_t) _nThreads, std::max((size_t) 1, _valT.size() / MIN_TRANSPOSE_SHARE));
+    std::vector<int> bounds(nThreads + 1);
+    bounds[0] = 0;
+    for (int t = 1; t < nThreads; t++) {
+        long nz = (long) _valT.size() / nThreads * t;
+        bounds[t] = std::max(bounds[t - 1], (int) (std::upper_bound(_featureT.begin(), _featureT.end(), nz) - _featureT.begin()));
+    }
+    bounds[nThreads] = _nFeatures;
+    return bounds;
+}
+
+void SparseData::measureBlocks(int start, int end) {
+    for (int f = start; f < end; f++) {
+        long first = f == 0 ? 0 : _featureT[f - 1];
+        long b = f == 0 ? 0 : _blockT[f - 1];
+        for (long pos = first; pos < _featureT[f]; pos += COLUMN_BLOCK, b++) {
+            long blockEnd = std::min(pos + COLUMN_BLOCK, _featureT[f]);
+            unsigned int largest = 0;
+            for (long i = pos + 1; i < blockEnd; i++)
+                largest = std::max(largest, (unsigned int) (_userT[i] - _userT[i - 1]));
+            int width = 0;
+            while (largest >> width)
+                width++;
+            _blockFirst[b] = _userT[pos];
+            _blockWidth[b] = width;
+        }
+    }
+}
+
+void SparseData::packBlocks(int start, int end) {
+    for (int f = start; f < end; f++) {
+        long first = f == 0 ? 0 : _featureT[f - 1];
+        long b = f == 0 ? 0 : _blockT[f - 1];
+        for (long pos = first; pos < _featureT[f]; pos += COLUMN_BLOCK, b++) {
+            long blockEnd = std::min(pos + COLUMN_BLOCK, _featureT[f]);
+            int width = _blockWidth[b];
+            unsigned char *out = &_packed[_blockByte[b]];
+            boost::uint64_t bits = 0;
+            int nBits = 0;
+            for (long i = pos + 1; i < blockEnd; i++) {
+                bits |= (boost::uint64_t) (_userT[i] - _userT[i - 1]) << nBits;
+                for (nBits += width; nBits >= 8; nBits -= 8) {
+                    *out++ = bits & 0xff;
+                    bits >>= 8;
+                }
+            }
+            if (nBits > 0)
+                *out = bits & 0xff;
+        }
+    }
+}
+
+void SparseData::compress() {
+    _blockT.resize(_nFeatures);
+    long nBlocks = 0;
+    for (size_t f = 0; f < _nFeatures; f++) {
+        long length = _featureT[f] - (f == 0 ? 0 : _featureT[f - 1]);
+        nBlocks += (length + COLUMN_BLOCK - 1) / COLUMN_BLOCK;
+        _blockT[f] = nBlocks;
+    }
+    _blockFirst.resize(nBlocks);
+    _blockWidth.resize(nBlocks);
+    _blockByte.resize(nBlocks + 1);
+
+    std::vector<int> bounds = featureRanges();
+    int nThreads = bounds.size() - 1;
+    if (nThreads == 1) {
+        measureBlocks(0, _nFeatures);
+    } else {
+        boost::thread_group pool;
+        for (int t = 0; t < nThreads; t++)
+            if (bounds[t] < bounds[t + 1])
+                pool.create_thread(boost::bind(&SparseData::measureBlocks, this, bounds[t], bounds[t + 1]));
+        pool.join_all();
+    }
+
+    _blockByte[0] = 0;
+    long b = 0;
+    for (size_t f = 0; f < _nFeatures; f++) {
+        for (long pos = f == 0 ? 0 : _featureT[f - 1]; pos < _featureT[f]; pos += COLUMN_BLOCK, b++) {
+            long n = std::min((long) COLUMN_BLOCK, _featureT[f] - pos);
+            _blockByte[b + 1] = _blockByte[b] + ((n - 1) * _blockWidth[b] + 7) / 8;
+        }
+    }
+    // unpackBlock() reads 8 bytes at a time, which may pass the last block
+    _packed.assign(_blockByte[nBlocks] + 8, 0);
+
+    if (nThreads == 1) {
+        packBlocks(0, _nFeatures);
+    } else {
+        boost::thread_group pool;
+        for (int t = 0; t < nThreads; t++)
+            if (bounds[t] < bounds[t + 1])
+                pool.create_thread(boost::bind(&SparseData::packBlocks, this, bounds[t], bounds[t + 1]));
+        pool.join_all();
+    }
+
+    std::cout << "compressed column rows:" << _packed.size() + nBlocks * (sizeof(int) + 1 + sizeof(long))
+            << " bytes, from " << _userT.size() * sizeof(int) << std::endl;
+    std::vector<int> empty;
+    _userT.swap(empty);
+}
+
+inline void SparseData::unpackBlock(long b, int n, int *rows) {
+    const unsigned char *in = &_packed[_blockByte[b]];
+    int width = _blockWidth[b];
+    boost::uint32_t mask = (boost::uint32_t) ((1ULL << width) - 1);
+    // the differences are independent of each other, and added up in a second pass
+    rows[0] = _blockFirst[b];
+    for (int i = 1; i < n; i++) {
+        long bit = (long) (i - 1) * width;
+        boost::uint64_t word;
+        memcpy(&word, in + (bit >> 3), sizeof(word));
+        rows[i] = (int) ((word >> (bit & 7)) & mask);
+    }
+    for (int i = 1; i < n; i++)
+        rows[i] += rows[i - 1];
+}
+
+// the first position in [idx, end) of the sorted list whose value is not less than v, found
+// by doubling the step from idx and then binary searching the last step
+static inline int gallop(const int *list, int idx, int end, int v) {
+    int step = 1;
+    int lo = idx;
+    while (lo + step < end && list[lo + step] < v) {
+        lo += step;
+        step <<= 1;
+    }
+    int hi = std::min(lo + step, end);
+    return std::lower_bound(list + lo, list + hi, v) - list;
+}
+
+// the same as gallop(), for lists of comparable lengths where v is usually close to idx. the
+// sorted list is compared against v a block at a time, and the values less than v are a prefix
+// of the block
+static inline int scan(const int *list, int idx, int end, int v) {
+#if defined(__AVX2__)
+    const __m256i vv = _mm256_set1_epi32(v);
+    while (idx + 8 <= end) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (list + idx));
+        int less = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(vv, block)));
+        if (less != 0xff)
+            return idx + __builtin_ctz(~less);
+        idx += 8;
+    }
+#elif defined(__SSE2__)
+    const __m128i vv = _mm_set1_epi32(v);
+    while (idx + 4 <= end) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (list + idx));
+        int less = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vv, block)));
+        if (less != 0xf)
+            return idx + __builtin_ctz(~less);
+        idx += 4;
+    }
+#endif
+    while (idx < end && list[idx] < v)
+        idx++;
+    return idx;
 }
 
 void SparseData::iterator(DataSubsetIterator *iter, int feature, std::vector<int> &indeces) {
-    iter->_rows = &_userT;
-    iter->_vals = &_valT;
+    if (!_columns)
+        throw std::runtime_error("sparse data loaded for evaluation cannot be iterated by feature");
+    iter->_rows = NULL;
+    iter->_vals = NULL;
+    iter->_sparse = true;
     iter->_idx = 0;
     iter->_size = 0;
+    if (_compressed) {
+        compressedIterator(iter, feature, indeces);
+        return;
+    }
     
-    int start = feature <= 0 ? 0 : _featureT[feature-1];
-    int end = _featureT[feature];
-    
-    size_t i = 0;
-    int idx = start;
-    while (i < indeces.size() && idx < end) {
-        while (idx < end && indeces[i] > iter->_rows->at(idx))
-            idx++;
-        if (idx < end) {
-            while (i < indeces.size() && indeces[i] < iter->_rows->at(idx))
-                i++;
-            while (i < indeces.size() && indeces[i] == iter->_rows->at(idx)) {
-                iter->_indeces.push_back(idx);
-                iter->_size++;
+    long first = feature <= 0 ? 0 : _featureT[feature-1];
+    int end = _featureT[feature] - first; // the column has at most one value per user
+    int start = 0;
+    int nUsers = indeces.size();
+    if (start == end || nUsers == 0)
+        return;
+
+    // positions are relative to the start of the column, so that they fit in an int
+    iter->_rows = &_userT[first];
+    iter->_vals = &_valT[first];
+
+    // indeces may repeat a user, and every repetition is a separate entry of the iterator
+    const int *rows = iter->_rows;
+    const int *users = &indeces[0];
+    std::vector<int> &out = iter->_indeces;
+    out.reserve(std::min(nUsers, end - start));
+
+    if ((long) nUsers * GALLOP_RATIO < end - start) {
+        // a small node on a long column: search the column for each user
+        int idx = start;
+        int i = 0;
+        while (i < nUsers && idx < end) {
+            idx = gallop(rows, idx, end, users[i]);
+            if (idx < end && rows[idx] == users[i])
+                for (int u = users[i]; i < nUsers && users[i] == u; i++)
+                    out.push_back(idx);
+            else
                 i++;
+        }
+    } else if ((long) (end - start) * GALLOP_RATIO < nUsers) {
+        // a short column: search the users for each row of the column
+        int i = 0;
+        for (int idx = start; idx < end && i < nUsers; idx++) {
+            i = gallop(users, i, nUsers, rows[idx]);
+            for (; i < nUsers && users[i] == rows[idx]; i++)
+                out.push_back(idx);
+        }
+    } else {
+        // comparable lengths: a merge that skips ahead in whichever list is behind
+        int idx = start;
+        int i = 0;
+        while (i < nUsers && idx < end) {
+            idx = scan(rows, idx, end, users[i]);
+            if (idx == end)
+                break;
+            i = scan(users, i, nUsers, rows[idx]);
+            for (; i < nUsers && users[i] == rows[idx]; i++)
+                out.push_back(idx);
+        }
+    }
+    iter->_size = out.size();
+}
+
+void SparseData::compressedIterator(DataSubsetIterator *iter, int feature, std::vector<int> &indeces) {
+    long first = feature <= 0 ? 0 : _featureT[feature - 1];
+    long firstBlock = feature <= 0 ? 0 : _blockT[feature - 1];
+    int length = _featureT[feature] - first;
+    int nBlocks = _blockT[feature] - firstBlock;
+    int nUsers = indeces.size();
+    if (length == 0 || nUsers == 0)
+        return;
+
+    // the iterator gets copies of the matching rows and values, so that it reads them the same
+    // way as from an uncompressed column
+    const int *firsts = &_blockFirst[firstBlock];
+    const int *users = &indeces[0];
+    std::vector<int> &rowsOut = iter->_rowBuffer;
+    std::vector<double> &valsOut = iter->_valBuffer;
+    rowsOut.reserve(std::min(nUsers, length));
+    valsOut.reserve(std::min(nUsers, length));
+    int rows[COLUMN_BLOCK];
+
+    int b = 0;
+    int i = 0;
+    while (i < nUsers && b < nBlocks) {
+        // skip to the last block starting at or before the next user, without decoding the
+        // blocks in between
+        b = std::max(b, gallop(firsts, b, nBlocks, users[i] + 1) - 1);
+        int n = std::min(COLUMN_BLOCK, length - b * COLUMN_BLOCK);
+        unpackBlock(firstBlock + b, n, rows);
+        const double *vals = &_valT[first + (long) b * COLUMN_BLOCK];
+
+        int idx = 0;
+        while (i < nUsers && idx < n) {
+            idx = scan(rows, idx, n, users[i]);
+            if (idx == n)
+                break;
+            i = scan(users, i, nUsers, rows[idx]);
+            for (; i < nUsers && users[i] == rows[idx]; i++) {
+                rowsOut.push_back(rows[idx]);
+                valsOut.push_back(vals[idx]);
             }
         }
-    }    
+        b++;
+    }
+
+    if (rowsOut.empty())
+        return;
+    iter->_rows = &rowsOut[0];
+    iter->_vals = &valsOut[0];
+    iter->_size = rowsOut.size();
+    iter->_indeces.resize(rowsOut.size());
+    for (size_t k = 0; k < rowsOut.size(); k++)
+        iter->_indeces[k] = k;
 }
@@ -19,26 +19,96 @@
 #include "ExecutionConfiguration.h"
 #include <algorithm>
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
 #include <cassert>
+#include <stdexcept>
 
-Tree::Tree() : _maxDepth(0), _minSplit(0) {
+Tree::Tree() : _flatRoot(NULL), _maxDepth(0), _minSplit(0), _levelWise(false), _extraTrees(false), _featureIds(NULL) {
     if (ExecutionConfiguration::intExists("maxdepth"))
         _maxDepth = ExecutionConfiguration::getInt("maxdepth");
     if (ExecutionConfiguration::intExists("minsplit"))
         _minSplit = ExecutionConfiguration::getInt("minsplit");
+    if (ExecutionConfiguration::intExists("levelwise"))
+        _levelWise = ExecutionConfiguration::getInt("levelwise") != 0;
+    if (ExecutionConfiguration::intExists("extratrees"))
+        _extraTrees = ExecutionConfiguration::getInt("extratrees") != 0;
+}
+
+// splits the users of data into the ones that are missing the feature, and the ones that have
+// it along with their values. all three lists are in increasing user order
+template <bool sparse>
+static void collectValues(DataSubset &data, DataSubsetIterator &u, std::vector<int> &noValue, std::vector<double> &values, std::vector<int> &users) {
+    values.reserve(u.size());
+    users.reserve(u.size());
+
+    const std::vector<int> &userIndeces = data.getUsers();
+    size_t i = 0;
+    while (i < userIndeces.size()) {
+        assert(!u.hasNext() || u.index<sparse>() >= userIndeces[i]);
+        while (i < userIndeces.size() && (!u.hasNext() || u.index<sparse>() > userIndeces[i])) {
+            noValue.push_back(userIndeces[i]);
+            i++;
+        }
+        while (u.hasNext() && i < userIndeces.size() && u.index<sparse>() == userIndeces[i]) {
+            values.push_back(u.value<sparse>());
+            users.push_back(u.index<sparse>());
+            u.next();
+            i++;
+        }
+    }
+}
+
+void Tree::bestThreshold(DataSubset &data, int feature, double &score, double &split) {
+    std::vector<int> noValue;
+    std::vector<double> values;
+    std::vector<int> users;
+
+    DataSubsetIterator u(data, feature);
+    if (u.isSparse())
+        collectValues<true>(data, u, noValue, values, users);
+    else
+        collectValues<false>(data, u, noValue, values, users);
+    findSplit(data, noValue, values, users, score, split);
+}
+
+void Tree::findSplit(DataSubset &data, const std::vector<int> &noValue, std::vector<double> &values, const std::vector<int> &users, double &score, double &split) {
+    if (!_extraTrees || values.empty()) {
+        bestThreshold(data, noValue, values, users, score, split);
+        return;
+    }
+
+    // a threshold drawn uniformly from (min, max], so that both sides get values. a feature
+    // with a single value puts all of them above the threshold, like bestThreshold does
+    double mn = *std::min_element(values.begin(), values.end());
+    double mx = *std::max_element(values.begin(), values.end());
+    boost::uniform_real<> draw(0, 1);
+    split = mn < mx ? mx - (mx - mn) * draw(_rng) : mn - 1;
+    score = scoreThreshold(data, noValue, values, users, split);
 }
 
 void Tree::Node::splitData(DataSubset &data, std::vector<int> &noVal, std::vector<int> &greater, std::vector<int> &less) {
     DataSubsetIterator u(data, _feature);
+    if (u.isSparse())
+        splitData<true>(data, u, noVal, greater, less);
+    else
+        splitData<false>(data, u, noVal, greater, less);
+}
+
+template <bool sparse>
+void Tree::Node::splitData(DataSubset &data, DataSubsetIterator &u, std::vector<int> &noVal, std::vector<int> &greater, std::vector<int> &less) {
     noVal.reserve(data.nUsers() - u.size());
     greater.reserve(u.size());
     less.reserve(u.size());
 
-    std::vector<int> users = data.getUsers();
+    const std::vector<int> &users = data.getUsers();
 
     for (size_t i = 0; i < users.size(); i++) {
-        if (u.hasNext() && users[i] == u.index()) {
-            if (u.value() < _threshold) {
+        if (u.hasNext() && users[i] == u.index<sparse>()) {
+            if (u.value<sparse>() < _threshold) {
                 less.push_back(users[i]);
             }
             else {
@@ -52,27 +122,99 @@ void Tree::Node::splitData(DataSubset &data, std::vector<int> &noVal, std::vecto
 }
 
 void Tree::train(DataSubset &data, int nFeatures) {
+    _flat.clear();
+    _flatRoot = NULL;
+    clearValues();
     std::vector<int> tmp(data.getUsers());
     _users.swap(tmp);
-    train(data, data.getUsers(), &_root, nFeatures, 0);
+    if (_levelWise)
+        trainLevels(data, nFeatures);
+    else
+        train(data, data.getUsers(), &_root, nFeatures, 0);
 }
 
-void Tree::save(std::ofstream &out) {
+void Tree::save(std::ofstream &out, Data *data) {
+    _featureIds = data;
     save(&_root, out);
+    _featureIds = NULL;
 }
-void Tree::load(std::ifstream &in) {
+void Tree::load(std::ifstream &in, Data *data) {
+    _nodes.clear();
+    _flat.clear();
+    _flatRoot = NULL;
+    clearValues();
+    _featureIds = data;
     load(&_root, in);
+    _featureIds = NULL;
+}
+
+int Tree::savedFeature(Node *node) {
+    if (node->_isLeaf || !_featureIds)
+        return node->_feature;
+    return _featureIds->originalFeature(node->_feature);
+}
+
+int Tree::loadedFeature(int feature) {
+    if (!_featureIds)
+        return feature;
+    int f = _featureIds->projectedFeature(feature);
+    if (f < 0) {
+        std::ostringstream err;
+        err << "the forest splits on feature " << feature << ", which the feature filter drops";
+        throw std::runtime_error(err.str());
+    }
+    return f;
+}
+
+void Tree::flatten() {
+    _flat.assign(1, FlatNode());
+    flatten(&_root, 0);
+    _flatRoot = &_flat[0];
+}
+
+// fills _flat[index] with node, after placing the children of the node at the end of _flat.
+// subtrees that are shared in a compacted forest are laid out once for each parent
+void Tree::flatten(Node *node, size_t index) {
+    if (node->_isLeaf) {
+        _flat[index]._leaf = node;
+        _flat[index]._feature = FlatNode::LEAF;
+        _flat[index]._offset = 0;
+        return;
+    }
+
+    // the flags share the word with the feature
+    if ((unsigned int) node->_feature > FlatNode::FEATURE)
+        throw std::runtime_error("feature ids of 2^30 and above are not supported");
+
+    size_t children = _flat.size();
+    _flat.resize(children + (node->_noValue ? 3 : 2));
+    _flat[index]._threshold = node->_threshold;
+    _flat[index]._feature = node->_feature | (node->_noValue ? 0 : FlatNode::BINARY);
+    _flat[index]._offset = children - index;
+
+    flatten(node->_lessThan, children);
+    flatten(node->_greaterThan, children + 1);
+    if (node->_noValue)
+        flatten(node->_noValue, children + 2);
 }
 
 void Tree::Node::findUsedFeatures(std::vector<bool> &features) {
   if (!_isLeaf) {
       features[_feature] = true;
-      _noValue->findUsedFeatures(features);
+      if (_noValue)
+          _noValue->findUsedFeatures(features);
       _greaterThan->findUsedFeatures(features);
       _lessThan->findUsedFeatures(features);
   }
 }
 
+int Tree::Node::maxFeature() {
+    if (_isLeaf)
+        return -1;
+    int feature = std::max(_feature, std::max(_greaterThan->maxFeature(), _lessThan->maxFeature()));
+    return _noValue ? std::max(feature, _noValue->maxFeature()) : feature;
+}
+
 void Tree::train(DataSubset &data, const std::vector<int> &userIndeces, Node *node, int nFeatures, int depth) {    
     if (checkAndMakeLeaf(data, userIndeces, node, depth))
         return;
@@ -80,13 +222,13 @@ void Tree::train(DataSubset &data, const std::vector<int> &userIndeces, Node *no
     node->_isLeaf = false;
     node->_val = 0;
 
-    DataSubset dataSubset = data.createSubsetUsers(userIndeces);
+    DataSubset dataSubset = data.createSubsetUsers(userIndeces, true);
     double bestVal = 1e100;
     double bestSplit = 0;
     int bestFeature = -1;
     double val, split;
     if (nFeatures < data.nFeatures()) {
-        std::vector<int> features = data.getSomeFeatures(nFeatures);
+        std::vector<int> features = data.getSomeFeatures(nFeatures, _rng);
 
         for (std::vector<int>::iterator f = features.begin(); f != features.end(); ++f) {
             bestThreshold(dataSubset, *f, val, split);
@@ -119,58 +261,438 @@ void Tree::train(DataSubset &data, const std::vector<int> &userIndeces, Node *no
         // a rare edge case where there is no possible split of the data based on the features
         checkAndMakeLeaf(data, userIndeces, node, 0, true);
     } else {
-        node->_noValue = new Node;
-        train(dataSubset, noValue, node->_noValue, nFeatures, depth+1);
-        node->_greaterThan = new Node;
+        // without users that are missing the feature, the node is binary
+        if (!noValue.empty()) {
+            node->_noValue = _nodes.allocate();
+            train(dataSubset, noValue, node->_noValue, nFeatures, depth+1);
+        }
+        node->_greaterThan = _nodes.allocate();
         train(dataSubset, greaterThan, node->_greaterThan, nFeatures, depth+1);
-        node->_lessThan = new Node;
+        node->_lessThan = _nodes.allocate();
         train(dataSubset, lessThan, node->_lessThan, nFeatures, depth+1);
     }
 }
 
-Tree::Node *Tree::getNode(Data &data, int uid) {
-    Node *node = &_root;
- 
-    while (!node->_isLeaf) {
-        double v;
-        if (data.at(uid, node->_feature, v)) {
-            if (v < node->_threshold)
-                node = node->_lessThan;
+// collects the values of feature for the users whose node (nodeOf) is looking at the feature
+// (wanted), and marks these users as seen in this scan
+template <bool sparse>
+static void collectLevelValues(DataSubsetIterator &u, int feature, int scan, const std::vector<int> &nodeOf, const std::vector<int> &wanted,
+        std::vector<int> &seen, std::vector<std::vector<double> > &values, std::vector<std::vector<int> > &users) {
+    for (; u.hasNext(); u.next()) {
+        int user = u.index<sparse>();
+        int node = nodeOf[user];
+        if (wanted[node] != feature)
+            continue;
+        seen[user] = scan;
+        values[node].push_back(u.value<sparse>());
+        users[node].push_back(user);
+    }
+}
+
+// marks the users whose node is split on feature as seen in this scan, and keeps their values
+template <bool sparse>
+static void markLevelValues(DataSubsetIterator &u, int feature, int scan, const std::vector<int> &nodeOf, const std::vector<int> &wanted,
+        std::vector<int> &seen, std::vector<double> &userValue) {
+    for (; u.hasNext(); u.next()) {
+        int user = u.index<sparse>();
+        if (wanted[nodeOf[user]] != feature)
+            continue;
+        seen[user] = scan;
+        userValue[user] = u.value<sparse>();
+    }
+}
+
+// grows the same tree as train(), one depth level at a time. each feature sampled by any node
+// of the level is iterated once over all the users of the level, instead of once per node,
+// and every value is routed to the node of its user
+void Tree::trainLevels(DataSubset &data, int nFeatures) {
+    const std::vector<int> &allUsers = data.getUsers();
+    int nUsers = allUsers.empty() ? 0 : allUsers.back() + 1;
+    int nAll = data.nFeatures();
+
+    std::vector<Node *> nodes(1, &_root);
+    std::vector<std::vector<int> > nodeUsers(1, allUsers);
+
+    std::vector<int> nodeOf(nUsers);
+    std::vector<int> seen(nUsers, -1);
+    std::vector<double> userValue(nUsers);
+    int scan = 0;
+
+    for (int depth = 0; !nodes.empty(); depth++) {
+        // the nodes of the level that get split, and the features each of them samples
+        std::vector<Node *> active;
+        std::vector<std::vector<int> > activeUsers;
+        std::vector<std::vector<int> > features;
+        for (size_t n = 0; n < nodes.size(); n++) {
+            if (checkAndMakeLeaf(data, nodeUsers[n], nodes[n], depth))
+                continue;
+            nodes[n]->_isLeaf = false;
+            nodes[n]->_val = 0;
+            active.push_back(nodes[n]);
+            activeUsers.push_back(std::vector<int>());
+            activeUsers.back().swap(nodeUsers[n]);
+            if (nFeatures < nAll) {
+                features.push_back(data.getSomeFeatures(nFeatures, _rng));
+            } else {
+                features.push_back(std::vector<int>(nAll));
+                for (int f = 0; f < nAll; f++)
+                    features.back()[f] = f;
+            }
+        }
+        if (active.empty())
+            break;
+
+        // the users that are still in nodes being split, and their nodes
+        std::fill(nodeOf.begin(), nodeOf.end(), -1);
+        for (size_t n = 0; n < active.size(); n++)
+            for (size_t i = 0; i < activeUsers[n].size(); i++)
+                nodeOf[activeUsers[n][i]] = n;
+        std::vector<int> levelUsers;
+        for (size_t i = 0; i < allUsers.size(); i++)
+            if (nodeOf[allUsers[i]] >= 0)
+                levelUsers.push_back(allUsers[i]);
+        DataSubset level = data.createSubsetUsers(levelUsers, true);
+
+        // the sampled features, each with a node sampling it and its position in the sample of the
+        // node. sorted by feature, so that only the sampled features are visited, in order
+        std::vector<std::pair<int, std::pair<int, int> > > requests;
+        std::vector<std::vector<double> > scores(active.size());
+        std::vector<std::vector<double> > splits(active.size());
+        for (size_t n = 0; n < active.size(); n++) {
+            scores[n].resize(features[n].size());
+            splits[n].resize(features[n].size());
+            for (size_t k = 0; k < features[n].size(); k++)
+                requests.push_back(std::make_pair(features[n][k], std::make_pair((int) n, (int) k)));
+        }
+        std::sort(requests.begin(), requests.end());
+
+        // wanted is the feature each node is looking at, -1 once the node has its values
+        std::vector<int> wanted(active.size(), -1);
+        std::vector<std::vector<double> > values(active.size());
+        std::vector<std::vector<int> > users(active.size());
+        std::vector<int> noValue;
+        for (size_t first = 0, last = 0; first < requests.size(); first = last) {
+            int f = requests[first].first;
+            for (last = first; last < requests.size() && requests[last].first == f; last++)
+                wanted[requests[last].second.first] = f;
+
+            DataSubsetIterator u(level, f);
+            if (u.isSparse())
+                collectLevelValues<true>(u, f, scan, nodeOf, wanted, seen, values, users);
             else
-                node = node->_greaterThan;
+                collectLevelValues<false>(u, f, scan, nodeOf, wanted, seen, values, users);
+
+            for (size_t r = first; r < last; r++) {
+                int n = requests[r].second.first;
+                int k = requests[r].second.second;
+                noValue.clear();
+                for (size_t i = 0; i < activeUsers[n].size(); i++)
+                    if (seen[activeUsers[n][i]] != scan)
+                        noValue.push_back(activeUsers[n][i]);
+                findSplit(level, noValue, values[n], users[n], scores[n][k], splits[n][k]);
+                values[n].clear();
+                users[n].clear();
+                wanted[n] = -1;
+            }
+            scan++;
         }
-        else {
-            node = node->_noValue;
+
+        // like train(), the first of the sampled features with the best score wins. the nodes
+        // are then sorted by the feature they split on
+        std::vector<std::pair<int, int> > splitting;
+        for (size_t n = 0; n < active.size(); n++) {
+            double bestVal = 1e100;
+            double bestSplit = 0;
+            int bestFeature = -1;
+            for (size_t k = 0; k < features[n].size(); k++) {
+                if (scores[n][k] < bestVal) {
+                    bestVal = scores[n][k];
+                    bestSplit = splits[n][k];
+                    bestFeature = features[n][k];
+                }
+            }
+            active[n]->_feature = bestFeature;
+            active[n]->_threshold = bestSplit;
+            splitting.push_back(std::pair<int, int>(bestFeature, n));
+        }
+        std::sort(splitting.begin(), splitting.end());
+
+        // split the users of the nodes, again iterating each feature once
+        nodes.clear();
+        nodeUsers.clear();
+        for (size_t first = 0, last = 0; first < splitting.size(); first = last) {
+            int f = splitting[first].first;
+            for (last = first; last < splitting.size() && splitting[last].first == f; last++)
+                wanted[splitting[last].second] = f;
+            DataSubsetIterator u(level, f);
+            if (u.isSparse())
+                markLevelValues<true>(u, f, scan, nodeOf, wanted, seen, userValue);
+            else
+                markLevelValues<false>(u, f, scan, nodeOf, wanted, seen, userValue);
+
+            for (size_t r = first; r < last; r++) {
+                int n = splitting[r].second;
+                wanted[n] = -1;
+                Node *node = active[n];
+                std::vector<int> &nodeUsersN = activeUsers[n];
+                std::vector<int> noValue;
+                std::vector<int> greaterThan;
+                std::vector<int> lessThan;
+                for (size_t i = 0; i < nodeUsersN.size(); i++) {
+                    int user = nodeUsersN[i];
+                    if (seen[user] != scan)
+                        noValue.push_back(user);
+                    else if (userValue[user] < node->_threshold)
+                        lessThan.push_back(user);
+                    else
+                        greaterThan.push_back(user);
+                }
+
+                if (noValue.size() == nodeUsersN.size() || greaterThan.size() == nodeUsersN.size() || lessThan.size() == nodeUsersN.size()) {
+                    // a rare edge case where there is no possible split of the data based on the features
+                    checkAndMakeLeaf(data, nodeUsersN, node, 0, true);
+                } else {
+                    // without users that are missing the feature, the node is binary
+                    if (!noValue.empty()) {
+                        node->_noValue = _nodes.allocate();
+                        nodes.push_back(node->_noValue);
+                        nodeUsers.push_back(std::vector<int>());
+                        nodeUsers.back().swap(noValue);
+                    }
+                    node->_greaterThan = _nodes.allocate();
+                    nodes.push_back(node->_greaterThan);
+                    nodeUsers.push_back(std::vector<int>());
+                    nodeUsers.back().swap(greaterThan);
+                    node->_lessThan = _nodes.allocate();
+                    nodes.push_back(node->_lessThan);
+                    nodeUsers.push_back(std::vector<int>());
+                    nodeUsers.back().swap(lessThan);
+                }
+            }
+            scan++;
         }
     }
-    
-    return node;
 }
 
+bool Tree::NodeKey::operator==(const NodeKey &other) const {
+    return _isLeaf == other._isLeaf && _value == other._value && _feature == other._feature &&
+            _threshold == other._threshold && _children[0] == other._children[0] &&
+            _children[1] == other._children[1] && _children[2] == other._children[2];
+}
 
-Tree::Node *Tree::getNodeOOB (Data &data, int uid, std::vector<int> &permutation, int feature) {
-    if (std::binary_search(_users.begin(), _users.end(), uid))
-        return NULL;
+size_t Tree::NodeKeyHash::operator()(const NodeKey &key) const {
+    std::tr1::hash<double> hashDouble;
+    size_t h = key._isLeaf ? 1 : 0;
+    h = h * 31 + key._value;
+    h = h * 31 + key._feature;
+    h = h * 31 + hashDouble(key._threshold);
+    for (int i = 0; i < 3; i++)
+        h = h * 31 + key._children[i];
+    return h;
+}
 
-    Node *node = &_root;
-    while (!node->_isLeaf) {
-        double v;
-        bool valueExists;
-        if (node->_feature == feature) {
-            assert(uid < permutation.size());
-            valueExists = data.at(permutation[uid], feature, v);
+const std::vector<double> &Tree::CompactTable::values(int feature) {
+    if (feature >= _data->nFeatures())
+        throw std::runtime_error("forest uses features that are not in the data");
+    if (_values.size() <= (size_t) feature)
+        _values.resize(feature + 1);
+    std::vector<double> &values = _values[feature];
+    if (values.empty()) {
+        DataSubset all = _data->createSubset();
+        for (DataSubsetIterator it(all, feature); it.hasNext(); it.next())
+            values.push_back(it.value());
+        std::sort(values.begin(), values.end());
+        values.erase(std::unique(values.begin(), values.end()), values.end());
+    }
+    return values;
+}
+
+int Tree::compact(CompactTable &table) {
+    return compact(&_root, table);
+}
+
+int Tree::compact(Node *node, CompactTable &table) {
+    table._nCompacted++;
+
+    NodeKey key;
+    key._isLeaf = node->_isLeaf;
+    key._value = 0;
+    key._feature = -1;
+    key._threshold = 0;
+    key._children[0] = key._children[1] = key._children[2] = -1;
+
+    bool isDouble = false;
+    if (node->_isLeaf) {
+        memcpy(&key._value, &node->_cls, sizeof(key._value));
+    } else {
+        if (node->_noValue)
+            key._children[0] = compact(node->_noValue, table);
+        key._children[1] = compact(node->_greaterThan, table);
+        key._children[2] = compact(node->_lessThan, table);
+        key._feature = node->_feature;
+
+        // a float threshold is enough if no training value falls between it and the original
+        // threshold. of those, the one with the fewest digits is kept, so that more subtrees
+        // are identical and the file is smaller
+        double threshold = node->_threshold;
+        const std::vector<double> &values = table.values(node->_feature);
+        isDouble = true;
+        key._threshold = threshold;
+        for (int digits = 1; digits <= 9 && isDouble; digits++) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.*g", digits, threshold);
+            double rounded = strtof(buf, NULL);
+            std::vector<double>::const_iterator v = std::lower_bound(values.begin(), values.end(), std::min(threshold, rounded));
+            if (v == values.end() || *v >= std::max(threshold, rounded)) {
+                isDouble = false;
+                key._threshold = rounded;
+            }
         }
-        else
-            valueExists = data.at(uid, node->_feature, v);
-        
-        if (valueExists) {
-            if (v < node->_threshold)
-                node = node->_lessThan;
-            else
-                node = node->_greaterThan;
+    }
+
+    std::tr1::unordered_map<NodeKey, int, NodeKeyHash>::iterator found = table._index.find(key);
+    if (found != table._index.end())
+        return found->second;
+
+    Node *compacted = table._pool.allocate();
+    compacted->_isLeaf = node->_isLeaf;
+    compacted->_cls = node->_cls;
+    compacted->_feature = key._feature;
+    compacted->_threshold = key._threshold;
+    if (!node->_isLeaf) {
+        if (node->_noValue)
+            compacted->_noValue = table._nodes[key._children[0]];
+        compacted->_greaterThan = table._nodes[key._children[1]];
+        compacted->_lessThan = table._nodes[key._children[2]];
+    }
+
+    int id = table._nodes.size();
+    table._nodes.push_back(compacted);
+    table._isDouble.push_back(isDouble);
+    table._index[key] = id;
+    return id;
+}
+
+void Tree::CompactTable::flatten(const std::vector<int> &roots) {
+    _flat.assign(roots.size(), FlatNode());
+    std::tr1::unordered_map<Node *, size_t> groups;
+    for (size_t i = 0; i < _nodes.size(); i++) {
+        Node *node = _nodes[i];
+        if (!node->_isLeaf) {
+            groups[node] = _flat.size();
+            _flat.resize(_flat.size() + (node->_noValue ? 3 : 2));
+        }
+    }
+
+    for (size_t r = 0; r < roots.size(); r++)
+        flatten(r, _nodes[roots[r]], groups);
+    for (size_t i = 0; i < _nodes.size(); i++) {
+        Node *node = _nodes[i];
+        if (node->_isLeaf)
+            continue;
+        size_t children = groups[node];
+        flatten(children, node->_lessThan, groups);
+        flatten(children + 1, node->_greaterThan, groups);
+        if (node->_noValue)
+            flatten(children + 2, node->_noValue, groups);
+    }
+}
+
+// fills _flat[slot] with node, pointing to the group of its children
+void Tree::CompactTable::flatten(size_t slot, Node *node, std::tr1::unordered_map<Node *, size_t> &groups) {
+    FlatNode &flat = _flat[slot];
+    if (node->_isLeaf) {
+        flat._leaf = node;
+        flat._feature = FlatNode::LEAF;
+        flat._offset = 0;
+        return;
+    }
+
+    // the flags share the word with the feature
+    if ((unsigned int) node->_feature > FlatNode::FEATURE)
+        throw std::runtime_error("feature ids of 2^30 and above are not supported");
+
+    flat._threshold = node->_threshold;
+    flat._feature = node->_feature | (node->_noValue ? 0 : FlatNode::BINARY);
+    flat._offset = (long) groups[node] - (long) slot;
+}
+
+int Tree::floatDigits(float value) {
+    char buf[32];
+    for (int digits = 1; digits < 9; digits++) {
+        snprintf(buf, sizeof(buf), "%.*g", digits, value);
+        if (strtof(buf, NULL) == value)
+            return digits;
+    }
+    return 9;
+}
+
+void Tree::setRoot(CompactTable &table, int tree, int root) {
+    _root = *table._nodes[root];
+    _flat.clear();
+    _flatRoot = &table._flat[tree];
+}
+
+// one line per node, leaves are "1 <value>" and other nodes are
+// "<kind> <threshold> <feature> <noValue> <greaterThan> <lessThan>", children given by their line.
+// noValue is -1 for a binary node. a threshold rounded to float is written with the digits that read
+// back that float, as kind 2, and one that needs double precision with 17, as kind 0
+void Tree::saveCompact(CompactTable &table, std::ofstream &out) {
+    std::tr1::unordered_map<Node *, int> ids;
+    for (size_t i = 0; i < table._nodes.size(); i++) {
+        Node *node = table._nodes[i];
+        ids[node] = i;
+        if (node->_isLeaf) {
+            out << COMPACT_LEAF << " ";
+            saveValue(node, out);
+            out << std::endl;
+        } else {
+            bool isDouble = table._isDouble[i];
+            out << (isDouble ? COMPACT_DOUBLE : COMPACT_FLOAT) << " " << std::setprecision(isDouble ? 17 : floatDigits(node->_threshold)) <<
+                    node->_threshold << std::setprecision(6) << " " << node->_feature << " " <<
+                    (node->_noValue ? ids[node->_noValue] : -1) << " " << ids[node->_greaterThan] << " " <<
+                    ids[node->_lessThan] << std::endl;
+        }
+    }
+}
+
+void Tree::loadCompact(CompactTable &table, int nNodes, std::ifstream &in, Data *data) {
+    _featureIds = data;
+    for (int i = 0; i < nNodes; i++) {
+        Node *node = table._pool.allocate();
+        int kind;
+        in >> kind;
+        if (!in.fail() && kind != COMPACT_DOUBLE && kind != COMPACT_LEAF && kind != COMPACT_FLOAT)
+            throw std::runtime_error("malformed compacted forest");
+        node->_isLeaf = kind == COMPACT_LEAF;
+        if (node->_isLeaf) {
+            loadValue(node, in);
+        } else {
+            // a float threshold is read as the float it was rounded to
+            if (kind == COMPACT_FLOAT) {
+                float threshold;
+                in >> threshold;
+                node->_threshold = threshold;
+            } else {
+                in >> node->_threshold;
+            }
+            int children[3];
+            in >> node->_feature >> children[0] >> children[1] >> children[2];
+            if (!in.fail())
+                node->_feature = loadedFeature(node->_feature);
+            // a binary node has no noValue child
+            for (int c = 0; c < 3; c++) {
+                if (children[c] < (c == 0 ? -1 : 0) || children[c] >= i)
+                    throw std::runtime_error("malformed compacted forest");
+            }
+            if (children[0] >= 0)
+                node->_noValue = table._nodes[children[0]];
+            node->_greaterThan = table._nodes[children[1]];
+            node->_lessThan = table._nodes[children[2]];
         }
-        else
-            node = node->_noValue;
+        if (in.fail())
+            throw std::runtime_error("malformed compacted forest");
+        table._nodes.push_back(node);
     }
-    return node;
+    _featureIds = NULL;
 }
@@ -22,59 +22,143 @@
 #include "RegressionForest.h"
 #include "DataSubset.h"
 #include "ExecutionConfiguration.h"
+#include "ScoringServer.h"
+#include "PredictionWriter.h"
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
+#include <cctype>
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
 #include <unistd.h>
+#include <sys/wait.h>
 
 void printUsage() {
     std::cout
             << "#--------------- common ---------------" << std::endl
-            << "<property=runmode    type=string>  train | evaluate" << std::endl
+            << "<property=runmode    type=string>  train | grow | resume | merge | compact | evaluate | stream | serve" << std::endl
             << "<property=forestmode type=string>  classification | regression" << std::endl
             << "<property=datamode   type=string>  sparse | dense" << std::endl
 
             << "<property=input      type=string>  filename of features" << std::endl
-            << "<property=forest     type=string>  filename for forest file. input for evaluation, output for training" << std::endl
+            << "<property=forest     type=string>  filename for forest file. input for evaluation, output for training, both for growing" << std::endl
             << "#--------------- optional for common ---------------" << std::endl
             << "<property=threads    type=integer> number of threads (default: 1)" << std::endl
             << std::endl
             << "#--------------- training ---------------" << std::endl
             << "<property=trees      type=integer> number of trees in the forest" << std::endl
-            << "<property=target     type=string>  target file" << std::endl
+            << "<property=target     type=string>  target file, a regression target may have one column per target, and a classification" << std::endl
+            << "                                   target one column per label, whose classes are output label by label" << std::endl
             << "<property=oob        type=integer> 1 for running out of bag evaluation, 0 for no OOB (default: 0)" << std::endl
             << "<property=relevance  type=string>  a file name to which to write features relevance" << std::endl
             << "#--------------- optional for training ---------------" << std::endl
             << "<property=features   type=string>  log | sqrt (default: sqrt)" << std::endl
-            << "<property=filter     type=string>  file with a filter for which features to use" << std::endl
+            << "<property=filter     type=string>  file with a filter for which features to use, the others are not loaded" << std::endl
             << "<property=maxdepth   type=integer> maximum depth of each tree (default: 0, unlimited)" << std::endl
             << "<property=minsplit   type=integer> minimum number of usecases in a node being split (default: 2)" << std::endl
+            << "<property=levelwise  type=integer> 1 for growing the trees one depth level at a time, scanning each feature once per level." << std::endl
+            << "                                   faster for deep trees on sparse data (default: 0)" << std::endl
+            << "<property=extratrees type=integer> 1 for extremely randomized trees, splitting each sampled feature at a single random threshold (default: 0)" << std::endl
+            << "<property=bootstrap  type=integer> 0 for training every tree on all the usecases instead of a bootstrap sample, disables oob and relevance (default: 1)" << std::endl
+            << "<property=bagfraction type=double> size of the sample of each tree, as a fraction of the usecases in (0, 1]." << std::endl
+            << "                                   requires bootstrap (default: 1)" << std::endl
+            << "<property=replacement type=integer> 0 for drawing the sample of each tree without replacement, requires bootstrap (default: 1)" << std::endl
+            << "<property=compresscolumns type=integer> sparse: 1 for keeping the rows of each feature delta encoded in bit packed" << std::endl
+            << "                                   blocks, which takes less memory and bandwidth but needs decoding (default: 0)" << std::endl
+            << "<property=seed       type=integer> seed for bagging and feature sampling (default: current time)" << std::endl
+            << "<property=checkpoint type=string>  file to which trees are written while training" << std::endl
+            << "<property=checkpointinterval type=integer> number of trees between checkpoint writes (default: 10)" << std::endl
+            << "<property=workers    type=integer> number of processes sharing the trees. without worker, they are started locally and merged" << std::endl
+            << "<property=worker     type=integer> index of this process, it trains its share of the trees into <forest>.<worker>." << std::endl
+            << "                                   requires seed to be the same in all workers, oob and relevance are not supported" << std::endl
+            << std::endl
+            << "#--------------- growing (same properties as training, oob and relevance are not supported) ---------------" << std::endl
+            << "<property=trees      type=integer> number of trees in the forest after adding trees to the existing forest" << std::endl
+            << "<property=seed       type=integer> seed the existing forest was trained with, the new trees take the seeds after" << std::endl
+            << "                                   its trees, so growing gives the forest training all the trees would (default: current time)" << std::endl
+            << std::endl
+            << "#--------------- resuming (same properties as training, oob and relevance are not supported) ---------------" << std::endl
+            << "<property=checkpoint type=string>  checkpoint file written by an interrupted training, training continues from it" << std::endl
+            << std::endl
+            << "#--------------- merging (only forest and workers are used) ---------------" << std::endl
+            << "<property=workers    type=integer> number of forests <forest>.0 ... <forest>.<workers-1>, merged into <forest>" << std::endl
             << std::endl
             << "#--------------- evaluation ---------------" << std::endl
             << "<property=output     type=string>  output file" << std::endl
             << "#--------------- optional for evaluation ---------------" << std::endl
-            << "<property=relevance  type=string>  conpute feature relevance, and print to file" << std::endl;
+            << "<property=outputformat type=string> text | binary, a Matrix Market array, or a header followed by 32 bit floats" << std::endl
+            << "                                   a row at a time, see PredictionWriter.h (default: text)" << std::endl
+            << "<property=relevance  type=string>  conpute feature relevance, and print to file" << std::endl
+            << "<property=earlyexit  type=integer> classification: 1 to stop evaluating trees once the class can't change (default: 0)" << std::endl
+            << "<property=confidence type=double>  classification: stop evaluating trees once the class is decided with this confidence" << std::endl
+            << std::endl
+            << "#--------------- compacting (input is the training data, used to round thresholds) ---------------" << std::endl
+            << "<property=output     type=string>  file for the compacted forest, which can be used for evaluation" << std::endl
+            << std::endl
+            << "#--------------- streaming (rows are scored and written a block at a time) ---------------" << std::endl
+            << "<property=input      type=string>  file of rows, one per line, or - for stdin. a dense row is its values," << std::endl
+            << "                                   a sparse row is <feature>:<value> pairs. lines starting with % are skipped" << std::endl
+            << "<property=output     type=string>  file, or - for stdout, with a line of class probabilities or regression values per row" << std::endl
+            << "#--------------- optional for streaming ---------------" << std::endl
+            << "<property=blocksize  type=integer> number of rows read and scored together, at least 1 (default: 10000)" << std::endl
+            << std::endl
+            << "#--------------- serving (input is not used) ---------------" << std::endl
+            << "<property=socket     type=string>  path of the unix domain socket to listen on" << std::endl
+            << "#--------------- optional for serving ---------------" << std::endl
+            << "<property=batchsize  type=integer> maximum number of rows evaluated together (default: 64)" << std::endl
+            << "<property=batchwait  type=integer> microseconds to wait for more rows before evaluating a batch (default: 1000)" << std::endl;
 }
 
 bool verifyOptions() {
     if (!ExecutionConfiguration::stringExists("runmode"))
         return false;
+    if (ExecutionConfiguration::getString("runmode").compare("merge") == 0)
+        return ExecutionConfiguration::stringExists("forest") && ExecutionConfiguration::intExists("workers");
     if (!ExecutionConfiguration::stringExists("forestmode"))
         return false;
     if (!ExecutionConfiguration::stringExists("datamode"))
         return false;
-    if (!ExecutionConfiguration::stringExists("input"))
-        return false;
     if (!ExecutionConfiguration::stringExists("forest"))
         return false;
-    if (ExecutionConfiguration::getString("runmode").compare("train") == 0) {
+    if (ExecutionConfiguration::getString("runmode").compare("serve") == 0)
+        return ExecutionConfiguration::stringExists("socket");
+    if (!ExecutionConfiguration::stringExists("input"))
+        return false;
+    if (ExecutionConfiguration::getString("runmode").compare("train") == 0 ||
+            ExecutionConfiguration::getString("runmode").compare("grow") == 0 ||
+            ExecutionConfiguration::getString("runmode").compare("resume") == 0) {
         if (!ExecutionConfiguration::intExists("trees"))
             return false;
         if (!ExecutionConfiguration::stringExists("target"))
             return false;
-    } else if (ExecutionConfiguration::getString("runmode").compare("evaluate") == 0) {
+        if (ExecutionConfiguration::getString("runmode").compare("resume") == 0 &&
+                !ExecutionConfiguration::stringExists("checkpoint"))
+            return false;
+        if (ExecutionConfiguration::intExists("worker") &&
+                (!ExecutionConfiguration::intExists("workers") || !ExecutionConfiguration::intExists("seed") ||
+                ExecutionConfiguration::getInt("worker") < 0 ||
+                ExecutionConfiguration::getInt("worker") >= ExecutionConfiguration::getInt("workers")))
+            return false;
+        if (ExecutionConfiguration::doubleExists("bagfraction") &&
+                !(ExecutionConfiguration::getDouble("bagfraction") > 0 && ExecutionConfiguration::getDouble("bagfraction") <= 1))
+            return false;
+        // without bootstrap every tree gets all the usecases, so there is no sample to configure
+        bool bootstrap = !ExecutionConfiguration::intExists("bootstrap") || ExecutionConfiguration::getInt("bootstrap");
+        if (!bootstrap && ((ExecutionConfiguration::doubleExists("bagfraction") && ExecutionConfiguration::getDouble("bagfraction") != 1) ||
+                (ExecutionConfiguration::intExists("replacement") && !ExecutionConfiguration::getInt("replacement"))))
+            return false;
+    } else if (ExecutionConfiguration::getString("runmode").compare("evaluate") == 0 ||
+            ExecutionConfiguration::getString("runmode").compare("stream") == 0 ||
+            ExecutionConfiguration::getString("runmode").compare("compact") == 0) {
         if (!ExecutionConfiguration::stringExists("output"))
             return false;
+        if (ExecutionConfiguration::intExists("blocksize") && ExecutionConfiguration::getInt("blocksize") < 1)
+            return false;
     } else {
         return false;
     }
@@ -82,15 +166,326 @@ bool verifyOptions() {
     return true;
 }
 
+// the file a worker writes its share of the forest (or checkpoint) to
+std::string workerFilename(const std::string &filename, int worker) {
+    std::ostringstream out;
+    out << filename << "." << worker;
+    return out.str();
+}
+
+int merge() {
+    std::vector<std::string> filenames;
+    for (int i = 0; i < ExecutionConfiguration::getInt("workers"); i++)
+        filenames.push_back(workerFilename(ExecutionConfiguration::getString("forest"), i));
+
+    std::cout << "Merging " << filenames.size() << " forests into " << ExecutionConfiguration::getString("forest") << std::endl;
+    try {
+        std::ofstream out(ExecutionConfiguration::getString("forest").c_str());
+        RandomForest::merge(filenames, out);
+    } catch (std::runtime_error &e) {
+        std::cerr << "Error occurred while merging forests: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// runs each worker as a separate process on this machine, and merges their forests
+int trainWorkers(char *program, char *config) {
+    int nWorkers = ExecutionConfiguration::getInt("workers");
+    int seed = ExecutionConfiguration::intExists("seed") ? ExecutionConfiguration::getInt("seed") : std::time(0);
+
+    std::vector<pid_t> pids;
+    for (int i = 0; i < nWorkers; i++) {
+        std::ostringstream worker, workerSeed;
+        worker << "worker=" << i;
+        workerSeed << "seed=" << seed;
+        std::string w = worker.str(), s = workerSeed.str();
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            char *args[] = {program, config, (char *) w.c_str(), (char *) s.c_str(), NULL};
+            execvp(program, args);
+            std::cerr << "could not start worker " << program << ": " << strerror(errno) << std::endl;
+            _exit(127);
+        } else if (pid < 0) {
+            std::cerr << "could not start worker: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        pids.push_back(pid);
+    }
+
+    bool failed = false;
+    for (size_t i = 0; i < pids.size(); i++) {
+        int status;
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "worker " << i << " failed" << std::endl;
+            failed = true;
+        }
+    }
+    if (failed)
+        return 1;
+
+    return merge();
+}
+
+int serve() {
+    int threads = ExecutionConfiguration::intExists("threads") ? ExecutionConfiguration::getInt("threads") : 1;
+    int batchSize = ExecutionConfiguration::intExists("batchsize") ? ExecutionConfiguration::getInt("batchsize") : 64;
+    int batchWait = ExecutionConfiguration::intExists("batchwait") ? ExecutionConfiguration::getInt("batchwait") : 1000;
+
+    // the forest only needs a data set while scoring, each batch brings its own
+    SparseData empty;
+    RandomForest *forest;
+    bool classification = ExecutionConfiguration::getString("forestmode").compare("classification") == 0;
+    if (classification)
+        forest = new ClassificationForest(&empty, 0, 0, threads);
+    else if (ExecutionConfiguration::getString("forestmode").compare("regression") == 0)
+        forest = new RegressionForest(&empty, 0, 0, threads);
+    else {
+        std::cout << "Unrecognized forest mode " << ExecutionConfiguration::getString("forestmode") << std::endl;
+        return 1;
+    }
+
+    try {
+        std::cout << "Loading forest " << ExecutionConfiguration::getString("forest") << std::endl;
+        std::ifstream in(ExecutionConfiguration::getString("forest").c_str());
+        forest->load(in);
+
+        ScoringServer server(forest, classification, batchSize, batchWait);
+        server.run(ExecutionConfiguration::getString("socket"));
+    } catch (std::runtime_error &e) {
+        std::cerr << "Error occurred while serving: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// parses a line of whitespace separated values
+static bool parseDenseRow(const char *line, std::vector<double> &row) {
+    row.clear();
+    char *end;
+    while (true) {
+        while (isspace(*line))
+            line++;
+        if (!*line)
+            return true;
+        row.push_back(strtod(line, &end));
+        if (end == line)
+            return false;
+        line = end;
+    }
+}
+
+// parses a line of <feature>:<value> pairs, and sorts them by feature
+static bool parseSparseRow(const char *line, std::vector<std::pair<int, double> > &row) {
+    row.clear();
+    char *end;
+    while (true) {
+        while (isspace(*line))
+            line++;
+        if (!*line)
+            break;
+        long f = strtol(line, &end, 10);
+        if (end == line || *end != ':' || f < 0)
+            return false;
+        line = end + 1;
+        double v = strtod(line, &end);
+        if (end == line)
+            return false;
+        line = end;
+        row.push_back(std::pair<int, double>(f, v));
+    }
+    std::sort(row.begin(), row.end());
+    return true;
+}
+
+// scores the rows of input a block at a time, writing the results of each block before reading
+// the next one, so that memory doesn't grow with the number of rows
+int stream() {
+    int threads = ExecutionConfiguration::intExists("threads") ? ExecutionConfiguration::getInt("threads") : 1;
+    int blockSize = ExecutionConfiguration::intExists("blocksize") ? ExecutionConfiguration::getInt("blocksize") : 10000;
+    bool dense = ExecutionConfiguration::getString("datamode").compare("dense") == 0;
+    bool classification = ExecutionConfiguration::getString("forestmode").compare("classification") == 0;
+
+    DenseData denseData;
+    SparseData sparseData;
+    Data *data = dense ? (Data *) &denseData : (Data *) &sparseData;
+    RandomForest *forest;
+    if (classification)
+        forest = new ClassificationForest(data, 0, 0, threads);
+    else
+        forest = new RegressionForest(data, 0, 0, threads);
+
+    std::string inputName = ExecutionConfiguration::getString("input");
+    std::string outputName = ExecutionConfiguration::getString("output");
+    std::ifstream inFile;
+    std::ofstream outFile;
+    if (inputName.compare("-") != 0)
+        inFile.open(inputName.c_str());
+    if (outputName.compare("-") != 0)
+        outFile.open(outputName.c_str());
+    std::istream &in = inputName.compare("-") == 0 ? std::cin : inFile;
+    std::ostream &out = outputName.compare("-") == 0 ? std::cout : outFile;
+
+    try {
+        std::ifstream forestIn(ExecutionConfiguration::getString("forest").c_str());
+        forest->load(forestIn);
+        if (!in)
+            throw std::runtime_error("could not open " + inputName);
+        if (outputName.compare("-") != 0 && !outFile.is_open())
+            throw std::runtime_error("could not open " + outputName);
+        int maxFeature = forest->maxFeature();
+
+        std::vector<double> denseRows, row;
+        std::vector<std::vector<std::pair<int, double> > > sparseRows(blockSize);
+        std::vector<std::vector<double> > prob;
+        std::vector<double> Y;
+        std::string line, text;
+        long lineNumber = 0;
+        int nFeatures = -1;
+        while (in) {
+            // read a block of rows, skipping comments. an empty line is a sparse row without features
+            int nRows = 0;
+            denseRows.clear();
+            while (nRows < blockSize && std::getline(in, line)) {
+                lineNumber++;
+                if (!line.empty() && line[0] == '%')
+                    continue;
+                bool parsed;
+                if (dense) {
+                    parsed = parseDenseRow(line.c_str(), row);
+                    if (nFeatures < 0) {
+                        // dense rows are read at the features of the forest without bounds checks
+                        nFeatures = row.size();
+                        if (parsed && nFeatures <= maxFeature) {
+                            std::ostringstream err;
+                            err << "rows have " << nFeatures << " columns, but the forest uses feature " << maxFeature;
+                            throw std::runtime_error(err.str());
+                        }
+                    }
+                    parsed = parsed && (int) row.size() == nFeatures;
+                    denseRows.insert(denseRows.end(), row.begin(), row.end());
+                } else {
+                    parsed = parseSparseRow(line.c_str(), sparseRows[nRows]);
+                }
+                if (!parsed) {
+                    std::ostringstream err;
+                    err << "malformed row at line " << lineNumber;
+                    throw std::runtime_error(err.str());
+                }
+                nRows++;
+            }
+            if (nRows == 0)
+                break;
+
+            if (dense) {
+                denseData.loadRows(denseRows, nFeatures);
+            } else {
+                sparseRows.resize(nRows);
+                sparseData.loadRows(sparseRows);
+                sparseRows.resize(blockSize);
+            }
+
+            // the lines of the block are formatted into one buffer, and written together
+            text.clear();
+            char buf[32];
+            if (classification) {
+                prob.resize(nRows);
+                ((ClassificationForest *) forest)->evaluate(prob);
+                for (int u = 0; u < nRows; u++) {
+                    for (size_t i = 0; i < prob[u].size(); i++) {
+                        if (i > 0)
+                            text += ' ';
+                        text.append(buf, PredictionWriter::format(prob[u][i], buf));
+                    }
+                    text += '\n';
+                }
+            } else {
+                int nTargets = ((RegressionForest *) forest)->nTargets();
+                Y.resize(nRows * nTargets);
+                ((RegressionForest *) forest)->evaluate(Y);
+                for (int u = 0; u < nRows; u++) {
+                    for (int t = 0; t < nTargets; t++) {
+                        if (t > 0)
+                            text += ' ';
+                        text.append(buf, PredictionWriter::format(Y[u * nTargets + t], buf));
+                    }
+                    text += '\n';
+                }
+            }
+            out.write(text.data(), text.size());
+            out.flush();
+            if (!out)
+                throw std::runtime_error("error while writing " + outputName);
+        }
+        if (in.bad())
+            throw std::runtime_error("error while reading " + inputName);
+    } catch (std::runtime_error &e) {
+        std::cerr << "Error occurred while streaming: " << e.what() << std::endl;
+        delete forest;
+        return 1;
+    }
+    delete forest;
+    return 0;
+}
+
+// runs a loading step on a thread of its own. join() waits for it, and rethrows its error
+class BackgroundLoad {
+protected:
+    boost::function<void ()> _load;
+    boost::thread _thread;
+    bool _failed;
+    std::string _error;
+
+    void run() {
+        try {
+            _load();
+        } catch (std::exception &e) {
+            _failed = true;
+            _error = e.what();
+        }
+    }
+
+public:
+    BackgroundLoad() : _failed(false) {}
+
+    ~BackgroundLoad() {
+        if (_thread.joinable())
+            _thread.join();
+    }
+
+    void start(const boost::function<void ()> &load) {
+        _load = load;
+        boost::thread thread(boost::bind(&BackgroundLoad::run, this));
+        _thread.swap(thread);
+    }
+
+    void join() {
+        if (_thread.joinable())
+            _thread.join();
+        if (_failed)
+            throw std::runtime_error(_error);
+    }
+};
+
 int main(int argc, char * argv[]) {
 
-    if (argc != 2) {
-        std::cerr << "usage: " << argv[0] << " config" << std::endl;
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " config [property=integer ...]" << std::endl;
         printUsage();
         exit(1);
     }
 
     ExecutionConfiguration::parseConfiguration(argv[1]);
+    // integer properties on the command line override the configuration, e.g. worker=3
+    for (int i = 2; i < argc; i++) {
+        const char *eq = strchr(argv[i], '=');
+        if (!eq) {
+            std::cerr << "Malformed property " << argv[i] << ", expected property=integer" << std::endl;
+            exit(2);
+        }
+        ExecutionConfiguration::setInt(std::string(argv[i], eq - argv[i]), atoi(eq + 1));
+    }
     if (!verifyOptions()) {
         std::cerr << "Errors while parsing configuration. Run with no parameters to see requirements." << std::endl;
         std::cerr << "Configuration:" << std::endl;
@@ -98,59 +493,151 @@ int main(int argc, char * argv[]) {
         exit(2);
     }
 
+    if (ExecutionConfiguration::getString("runmode").compare("serve") == 0)
+        return serve();
+    if (ExecutionConfiguration::getString("runmode").compare("stream") == 0)
+        return stream();
+    if (ExecutionConfiguration::getString("runmode").compare("merge") == 0)
+        return merge();
+    if (ExecutionConfiguration::getString("runmode").compare("train") == 0 &&
+            ExecutionConfiguration::intExists("workers") && !ExecutionConfiguration::intExists("worker"))
+        return trainWorkers(argv[0], argv[1]);
+
+    bool grow = ExecutionConfiguration::getString("runmode").compare("grow") == 0;
+    bool resume = ExecutionConfiguration::getString("runmode").compare("resume") == 0;
+    bool training = ExecutionConfiguration::getString("runmode").compare("train") == 0 || grow || resume;
+    bool evaluation = ExecutionConfiguration::getString("runmode").compare("evaluate") == 0;
+    bool classification = ExecutionConfiguration::getString("forestmode").compare("classification") == 0;
+    int threads = ExecutionConfiguration::intExists("threads") ? ExecutionConfiguration::getInt("threads") : 1;
+
+    // evaluation only traverses rows, so dense rows are loaded row major instead of by feature,
+    // and sparse data isn't transposed
     Data *d;
+    if (ExecutionConfiguration::getString("datamode").compare("dense") == 0)
+        d = new DenseData(evaluation);
+    else if (ExecutionConfiguration::getString("datamode").compare("sparse") == 0)
+        d = new SparseData(!evaluation, threads,
+                ExecutionConfiguration::intExists("compresscolumns") && ExecutionConfiguration::getInt("compresscolumns"));
+    else {
+        std::cout << "Unrecognized data format " << ExecutionConfiguration::getString("datamode") << std::endl;
+        exit(1);
+    }
+
+    // the targets and the forest don't depend on the features, so they are read on
+    // threads of their own while the features are parsed, and checked against them afterwards.
+    // what the loads read from is declared first, so that it outlives them on an early return
+    std::vector<int> filter;
+    std::ifstream forestIn;
+    RandomForest *loaded = NULL; // the forest that is evaluated or compacted
+    BackgroundLoad targetLoad, forestLoad;
     try {
-        if (ExecutionConfiguration::getString("datamode").compare("dense") == 0)
-            d = new DenseData();
-        else if (ExecutionConfiguration::getString("datamode").compare("sparse") == 0)
-            d = new SparseData();
-        else {
-            std::cout << "Unrecognized data format " << ExecutionConfiguration::getString("datamode") << std::endl;
-            exit(1);
+        if (training) {
+            std::cout << "Loading " << ExecutionConfiguration::getString("forestmode") << " target file " <<
+                    ExecutionConfiguration::getString("target") << std::endl;
+            targetLoad.start(boost::bind(classification ? &Data::loadClassificationY : &Data::loadRegressionY,
+                    d, ExecutionConfiguration::getString("target")));
+        } else {
+            std::cout << "Loading forest " << ExecutionConfiguration::getString("forest") << std::endl;
+            if (classification)
+                loaded = new ClassificationForest(d, 0, 0, threads);
+            else
+                loaded = new RegressionForest(d, 0, 0, threads);
+            forestIn.open(ExecutionConfiguration::getString("forest").c_str());
+            forestLoad.start(boost::bind(&RandomForest::load, loaded, boost::ref(forestIn)));
         }
+        // the features the filter drops aren't loaded at all, so it is needed before the features
+        if (training && ExecutionConfiguration::stringExists("filter")) {
+            std::cout << "Using only features listed in file " << ExecutionConfiguration::getString("filter") << std::endl;
+            Data::readFeatureFilter(ExecutionConfiguration::getString("filter"), filter);
+            d->projectFeatures(filter);
+        }
+
         std::cout << "Loading feature file " << ExecutionConfiguration::getString("input") << std::endl;
         d->loadFeatures(ExecutionConfiguration::getString("input"));
-        if (ExecutionConfiguration::stringExists("filter")) {
-            std::cout << "Using only features listed in file " << ExecutionConfiguration::getString("filter") << std::endl;
-            d->filterFeatures(ExecutionConfiguration::getString("filter"));
+
+        targetLoad.join();
+        d->checkTargets();
+        forestLoad.join();
+        // a dense row has no room for features past its columns, so the forest must not split on them
+        if (loaded && ExecutionConfiguration::getString("datamode").compare("dense") == 0 &&
+                loaded->maxFeature() >= d->nFeatures()) {
+            std::ostringstream err;
+            err << "the input has " << d->nFeatures() << " features, but the forest uses feature " << loaded->maxFeature();
+            throw std::runtime_error(err.str());
         }
     } catch (std::runtime_error &e) {
         std::cerr << "Error occurred while reading file: " << e.what() << std::endl;
         return 1;
     }
 
-    if (ExecutionConfiguration::getString("runmode").compare("train") == 0) {
+    if (training) {
         std::cout << d->nFeatures() << " " << d->nFilteredFeatures() << " " << d->nUsers() << std::endl;
         int useFeatures = sqrt(d->nFilteredFeatures()) + 1;
         if (ExecutionConfiguration::stringExists("features") && ExecutionConfiguration::getString("features").compare("log") == 0)
             useFeatures = log(d->nFilteredFeatures()) + 1;
 
+        int nTrees = ExecutionConfiguration::getInt("trees");
+        std::string forestFilename = ExecutionConfiguration::getString("forest");
+        std::string checkpointFilename = ExecutionConfiguration::stringExists("checkpoint") ?
+                ExecutionConfiguration::getString("checkpoint") : "";
+        // a worker trains a contiguous share of the tree seeds. the seed of a tree drives both its bag
+        // and its feature sampling, so all workers together train the same trees a single process would
+        bool worker = !grow && ExecutionConfiguration::intExists("worker");
+        int seed = 0;
+        if (worker) {
+            int nWorkers = ExecutionConfiguration::getInt("workers");
+            int w = ExecutionConfiguration::getInt("worker");
+            seed = ExecutionConfiguration::getInt("seed") + nTrees / nWorkers * w + std::min(w, nTrees % nWorkers);
+            nTrees = nTrees / nWorkers + (w < nTrees % nWorkers ? 1 : 0);
+            forestFilename = workerFilename(forestFilename, w);
+            if (!checkpointFilename.empty())
+                checkpointFilename = workerFilename(checkpointFilename, w);
+            std::cout << "Worker " << w << " training " << nTrees << " trees" << std::endl;
+        }
+
         RandomForest *forest;
+        if (classification)
+            forest = new ClassificationForest(d, nTrees, useFeatures, threads);
+        else
+            forest = new RegressionForest(d, nTrees, useFeatures, threads);
 
-        try {
-            if (ExecutionConfiguration::getString("forestmode").compare("classification") == 0) {
-                std::cout << "Loading classification target file " << ExecutionConfiguration::getString("target") << std::endl;
-                d->loadClassificationY(ExecutionConfiguration::getString("target"));
-                forest = new ClassificationForest(d, ExecutionConfiguration::getInt("trees"), useFeatures,
-                        ExecutionConfiguration::intExists("threads") ? ExecutionConfiguration::getInt("threads") : 1);
-            } else if (ExecutionConfiguration::getString("forestmode").compare("regression") == 0) {
-                std::cout << "Loading regression target file " << ExecutionConfiguration::getString("target") << std::endl;
-                d->loadRegressionY(ExecutionConfiguration::getString("target"));
-                forest = new RegressionForest(d, ExecutionConfiguration::getInt("trees"), useFeatures,
-                        ExecutionConfiguration::intExists("threads") ? ExecutionConfiguration::getInt("threads") : 1);
+        if (worker)
+            forest->setSeed(seed);
+
+        if (grow) {
+            std::cout << "Loading forest " << ExecutionConfiguration::getString("forest") << std::endl;
+            std::ifstream in(ExecutionConfiguration::getString("forest").c_str());
+            try {
+                forest->load(in);
+                in.close();
+                forest->grow(ExecutionConfiguration::getInt("trees"));
+            } catch (std::runtime_error &e) {
+                std::cerr << "Error occurred while growing forest: " << e.what() << std::endl;
+                return 1;
             }
-        } catch (std::runtime_error &e) {
-            std::cerr << "Error occurred while reading file: " << e.what() << std::endl;
-            return 1;
+        } else {
+            try {
+                int interval = ExecutionConfiguration::intExists("checkpointinterval") ?
+                        ExecutionConfiguration::getInt("checkpointinterval") : 10;
+                if (resume)
+                    forest->resume(checkpointFilename, interval);
+                else if (!checkpointFilename.empty())
+                    forest->checkpoint(checkpointFilename, interval);
+            } catch (std::runtime_error &e) {
+                std::cerr << "Error occurred while reading checkpoint: " << e.what() << std::endl;
+                return 1;
+            }
+            forest->train();
         }
-
-        forest->train();
-        std::ofstream out(ExecutionConfiguration::getString("forest").c_str());
+        std::ofstream out(forestFilename.c_str());
         forest->save(out);
 
 
-        // support OOB evaluation for classification
-        if (ExecutionConfiguration::getString("forestmode").compare("classification") == 0 &&
+        // support OOB evaluation for classification. loaded trees don't know which
+        // users they were trained on, so it is only available for freshly trained forests.
+        // without bootstrap, every tree was trained on every user and nothing is out of bag
+        bool bootstrap = !ExecutionConfiguration::intExists("bootstrap") || ExecutionConfiguration::getInt("bootstrap");
+        if (!grow && !resume && !worker && bootstrap && ExecutionConfiguration::getString("forestmode").compare("classification") == 0 &&
                 (ExecutionConfiguration::stringExists("relevance") ||
                 (ExecutionConfiguration::intExists("oob") && ExecutionConfiguration::getInt("oob")))) {
             std::cout << "OOB evaluation" << std::endl;
@@ -161,47 +648,56 @@ int main(int argc, char * argv[]) {
             // the maximum index), nothing will get permuted, and this is doing straight up OOB evaluation
             cforest->evaluateOOB(probOOB, permutation, d->nFeatures()); 
 
-            // we use this to compute the AUC. For multi-class problems, we define the AUC as the average pair-wise AUC
+            // we use this to compute the AUC. For multi-class problems, we define the AUC as the average pair-wise AUC.
+            // with several labels, the scores are averaged over the labels, and over the pairs of classes
+            // each label has users of
             int nTrees = ExecutionConfiguration::getInt("trees");
-            std::vector<std::vector<std::vector<int> > > counts(nTrees+1);
-            for (size_t i = 0; i < counts.size(); ++i) {
-                counts[i].resize(cforest->nClasses());
-                for (size_t j = 0; j < counts[i].size(); ++j) {
-                    counts[i][j].resize(cforest->nClasses());
-                }
-            }
-            
+            int nClasses = cforest->nClasses(), nLabels = cforest->nLabels();
             double acc = 0;
-            
-            for (int u = 0; u < d->nUsers(); u++) {
-                assert(d->classificationY(u) < probOOB[u].size());
-                acc += probOOB[u][d->classificationY(u)];
-
-                assert(cforest->nClasses() == probOOB[u].size());
-                for (size_t i = 0; i < probOOB[u].size(); ++i) {
-                    long score = lround(probOOB[u][i] * nTrees);
-                    counts[score][d->classificationY(u)][i]++;
-                }                
-            }
             double totalAUC = 0;
-            for (int i = 0; i < cforest->nClasses(); ++i) {
-                for (int j = i+1; j < cforest->nClasses(); ++j) {
-                    double AUC0 = 0, cnt00 = 0, cnt01 = 0;
-                    double AUC1 = 0, cnt10 = 0, cnt11 = 0;
-                    for (size_t u = 0; u < counts.size(); ++u) {
-                        cnt00 += counts[u][i][i];
-                        cnt01 += counts[u][j][i];
-                        cnt10 += counts[u][i][j];
-                        cnt11 += counts[u][j][j];
-                        
-                        AUC0 += counts[u][i][i]*cnt01;
-                        AUC1 += counts[u][j][j]*cnt10;
+            int nPairs = 0;
+            for (int l = 0; l < nLabels; l++) {
+                std::vector<std::vector<std::vector<int> > > counts(nTrees+1);
+                for (size_t i = 0; i < counts.size(); ++i) {
+                    counts[i].resize(nClasses);
+                    for (size_t j = 0; j < counts[i].size(); ++j) {
+                        counts[i][j].resize(nClasses);
+                    }
+                }
+
+                for (int u = 0; u < d->nUsers(); u++) {
+                    const double *prob = &probOOB[u][l * nClasses];
+                    assert(d->classificationY(u, l) < nClasses);
+                    acc += prob[d->classificationY(u, l)];
+
+                    assert(nClasses * nLabels == probOOB[u].size());
+                    for (int i = 0; i < nClasses; ++i) {
+                        long score = lround(prob[i] * nTrees);
+                        counts[score][d->classificationY(u, l)][i]++;
+                    }                
+                }
+                for (int i = 0; i < nClasses; ++i) {
+                    for (int j = i+1; j < nClasses; ++j) {
+                        double AUC0 = 0, cnt00 = 0, cnt01 = 0;
+                        double AUC1 = 0, cnt10 = 0, cnt11 = 0;
+                        for (size_t u = 0; u < counts.size(); ++u) {
+                            cnt00 += counts[u][i][i];
+                            cnt01 += counts[u][j][i];
+                            cnt10 += counts[u][i][j];
+                            cnt11 += counts[u][j][j];
+
+                            AUC0 += counts[u][i][i]*cnt01;
+                            AUC1 += counts[u][j][j]*cnt10;
+                        }
+                        if (cnt00 > 0 && cnt11 > 0) {
+                            totalAUC += AUC0/cnt00/cnt01 + AUC1/cnt10/cnt11;
+                            nPairs++;
+                        }
                     }
-                    totalAUC += AUC0/cnt00/cnt01 + AUC1/cnt10/cnt11;
                 }
             }
-            acc = acc / d->nUsers();
-            totalAUC = totalAUC / cforest->nClasses() / (cforest->nClasses()-1);
+            acc = acc / d->nUsers() / nLabels;
+            totalAUC = totalAUC / nPairs / 2;
             std::cout << "OOB score: " << acc << std::endl;
             std::cout << "AUC score: " << totalAUC << std::endl;
 
@@ -212,67 +708,72 @@ int main(int argc, char * argv[]) {
                 std::vector<bool> usedFeatures(d->nFeatures());
                 forest->findUsedFeatures(usedFeatures);
                 std::vector<std::vector<double> > prob(d->nUsers());
-                std::ofstream fr(ExecutionConfiguration::getString("relevance").c_str());
-                fr << "%%MatrixMarket matrix array real general" << std::endl << "%" << std::endl
-                        << d->nFeatures() << " 1" << std::endl;
-
+                // relevance has a row per feature of the feature file, features dropped by the
+                // filter are 0
+                std::vector<double> relevance(d->nOriginalFeatures());
                 for (int f = 0; f < d->nFeatures(); f++) {
                     if (usedFeatures[f]) {
                         cforest->evaluateOOB(prob, permutation, f);
                         double permAcc = 0;
                         for (int u = 0; u < d->nUsers(); u++) {
-                            assert(d->classificationY(u) < prob[u].size());
-                            permAcc += prob[u][d->classificationY(u)];
+                            for (int l = 0; l < nLabels; l++) {
+                                assert(d->classificationY(u, l) < nClasses);
+                                permAcc += prob[u][l * nClasses + d->classificationY(u, l)];
+                            }
                         }
-                        permAcc = acc - permAcc / d->nUsers();
-                        fr << permAcc << std::endl;
-                    } else {
-                        fr << 0 << std::endl;
+                        relevance[d->originalFeature(f)] = acc - permAcc / d->nUsers() / nLabels;
                     }
                 }
+                std::ofstream fr(ExecutionConfiguration::getString("relevance").c_str());
+                fr << "%%MatrixMarket matrix array real general" << std::endl << "%" << std::endl
+                        << relevance.size() << " 1" << std::endl;
+                for (size_t f = 0; f < relevance.size(); f++)
+                    fr << relevance[f] << std::endl;
             }
         }
+        delete forest;
+    } else if (ExecutionConfiguration::getString("runmode").compare("compact") == 0) {
+        try {
+            std::ofstream out(ExecutionConfiguration::getString("output").c_str());
+            loaded->saveCompact(out);
+            out.flush();
+            if (!out)
+                throw std::runtime_error("could not write " + ExecutionConfiguration::getString("output"));
+            std::ifstream original(ExecutionConfiguration::getString("forest").c_str(), std::ios::ate);
+            std::cout << "Compacted forest file of " << out.tellp() << " bytes, from " << original.tellg() << std::endl;
+        } catch (std::runtime_error &e) {
+            std::cerr << "Error occurred while compacting forest: " << e.what() << std::endl;
+            return 1;
+        }
+        delete loaded;
     } else {
-        DataSubset ds = d->createSubset();
-        std::ifstream in(ExecutionConfiguration::getString("forest").c_str());
+        bool binary = ExecutionConfiguration::stringExists("outputformat") &&
+                ExecutionConfiguration::getString("outputformat").compare("binary") == 0;
+        PredictionWriter writer(threads, binary);
         try {
-            if (ExecutionConfiguration::getString("forestmode").compare("classification") == 0) {
-                ClassificationForest forest(d, 0, 0,
-                        ExecutionConfiguration::intExists("threads") ? ExecutionConfiguration::getInt("threads") : 1);
-                forest.load(in);
+            if (classification) {
+                ClassificationForest *forest = (ClassificationForest *) loaded;
                 std::vector<std::vector<double> > prob;
                 prob.resize(d->nUsers());
-                forest.evaluate(prob);
-
-                std::ofstream out(ExecutionConfiguration::getString("output").c_str());
-                out << "%%MatrixMarket matrix array real general" << std::endl << "%" << std::endl
-                        << d->nUsers() << " " << forest.nClasses() << std::endl;
-                for (int i = 0; i < forest.nClasses(); i++) {
-                    for (int u = 0; u < ds.nUsers(); u++) {
-                        assert(prob[u].size() == forest.nClasses());
-                        out << prob[u][i] << std::endl;
-                    }
-                }
-            } else if (ExecutionConfiguration::getString("forestmode").compare("regression") == 0) {
-                RegressionForest forest(d, 0, 0,
-                        ExecutionConfiguration::intExists("threads") ? ExecutionConfiguration::getInt("threads") : 1);
-                forest.load(in);
-                std::vector<double> Y(d->nUsers());
-                forest.evaluate(Y);
-
-                std::ofstream out(ExecutionConfiguration::getString("output").c_str());
-                out << "%%MatrixMarket matrix array real general" << std::endl << "%" << std::endl
-                        << d->nUsers() << " 1" << std::endl;
-                for (int u = 0; u < ds.nUsers(); u++) {
-                    out << Y[u] << std::endl;
-                }
+                forest->evaluate(prob);
+                std::cout << "Evaluated " << forest->treesEvaluated() * 100 << "% of the trees" << std::endl;
+
+                writer.write(ExecutionConfiguration::getString("output"), prob, forest->nClasses() * forest->nLabels());
+            } else {
+                RegressionForest *forest = (RegressionForest *) loaded;
+                int nTargets = forest->nTargets();
+                std::vector<double> Y(d->nUsers() * nTargets);
+                forest->evaluate(Y);
+
+                writer.write(ExecutionConfiguration::getString("output"), Y, nTargets);
             }
         } catch (std::runtime_error &e) {
-            std::cerr << "Error occurred while reading file: " << e.what() << std::endl;
+            std::cerr << "Error occurred while writing file: " << e.what() << std::endl;
             return 1;
         }
-
+        delete loaded;
     }
 
+    delete d;
     return 0;
 }
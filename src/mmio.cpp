@@ -204,6 +204,34 @@ int mm_read_mtx_crd_size(FILE *f, int *M, int *N, int *nz) {
     return 0;
 }
 
+/* the same as mm_read_mtx_crd_size, for files with more than 2^31 nonzeros */
+int mm_read_mtx_crd_size_long(FILE *f, int *M, int *N, long *nz) {
+    char line[MM_MAX_LINE_LENGTH];
+    int num_items_read;
+
+    /* set return null parameter values, in case we exit with errors */
+    *M = *N = 0;
+    *nz = 0;
+
+    /* now continue scanning until you reach the end-of-comments */
+    do {
+        if (fgets(line, MM_MAX_LINE_LENGTH, f) == NULL)
+            return MM_PREMATURE_EOF;
+    } while (line[0] == '%');
+
+    /* line[] is either blank or has M,N, nz */
+    if (sscanf(line, "%d %d %ld", M, N, nz) == 3)
+        return 0;
+
+    else
+        do {
+            num_items_read = fscanf(f, "%d %d %ld", M, N, nz);
+            if (num_items_read == EOF) return MM_PREMATURE_EOF;
+        } while (num_items_read != 3);
+
+    return 0;
+}
+
 int mm_read_mtx_array_size(FILE *f, int *M, int *N) {
     char line[MM_MAX_LINE_LENGTH];
     int num_items_read;